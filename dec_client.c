@@ -10,88 +10,135 @@
  * 
  * Arguments are first verified before an attempt to connect to the server is
  * made. Once connection is authenticated, ciphertext and key are sent to be
- * decrypted. Resulting plaintext is sent to standard output.
+ * decrypted, packed into 5-bit symbols if requested and accepted by the server.
+ * Requests and responses may also be checked against CRC32C trailers.
+ * Resulting plaintext is streamed to standard output or the output file.
+ * 
+ * In batch mode, every line of the ciphertext file is a record sent along with
+ * the line of the key file at the same position, with records grouped into
+ * batch frames; each resulting line of plaintext is output in order.
+ * 
+ * Given an output file, ciphertext and key may instead be split into aligned
+ * ranges sent over up to the given number of parallel connections, with each
+ * range of plaintext written in place to the output file.
  */
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <ciphertext file> <key file> <port>\n", argv[0]);
+    char* output;
+    int batch;
+    int connections;
+    int options;
+    int opt;
+
+    output = NULL;
+    batch = 0;
+    connections = 1;
+    options = 0;
+    while ((opt = getopt(argc, argv, "bcj:o:p")) != -1) {
+        switch (opt) {
+            case 'b':
+                batch = 1;
+                break;
+            case 'c':
+                options |= OPTION_CHECKSUM;
+                break;
+            case 'j':
+                connections = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'p':
+                options |= OPTION_PACKED;
+                break;
+            default:
+                connections = 0;
+                break;
+        }
+    }
+    if (argc - optind != 3 || connections <= 0 || (connections > 1 && (!output || batch))) {
+        fprintf(stderr, "Usage: %s [-b | -o output file -j connections] [-c] [-p] <ciphertext file> <key file> <port>\n", argv[0]);
         exit(1);
     }
 
     char* cwd;
     char* ciphertext;
-    char* ciphertext_sep;
     char* key;
-    char* auth;
-    char* message;
-    char* message_term;
-    char* plaintext;
     int ciphertext_fd;
     int key_fd;
-    int sock_fd;
-    struct sockaddr_in server_address;
+    int out_fd;
+    int status;
+    long len;
+    off_t offset;
 
     cwd = (char*)calloc(PATH_BUFFER_SIZE, sizeof(char));
     getcwd(cwd, PATH_BUFFER_SIZE);
 
-    ciphertext_fd = getFileDesc(cwd, argv[1]);
-    key_fd = getFileDesc(cwd, argv[2]);
+    ciphertext_fd = getFileDesc(cwd, argv[optind]);
+    key_fd = getFileDesc(cwd, argv[optind + 1]);
+    out_fd = output ? createFileDesc(cwd, output) : STDOUT_FILENO;
 
     free(cwd);
     cwd = NULL;
 
     if (!locatedFile(ciphertext_fd) || !locatedFile(key_fd))
         exit(1);
+    if (out_fd < 0) {
+        perror("open()");
+        exit(1);
+    }
 
-    ciphertext = getFileData(ciphertext_fd);
-    key = getFileData(key_fd);
+    // Standard output may be a file shared with other writers, so output
+    // starts wherever its file position was left
+    offset = output ? 0 : lseek(out_fd, 0, SEEK_CUR);
+    if (offset < 0)
+        offset = 0;
 
-    if (!allowedChars(ciphertext) || !allowedChars(key)
-        || !sufficientLength(key, strlen(ciphertext))) {
-            free(ciphertext);
-            ciphertext = NULL;
-            free(key);
-            key = NULL;
-            exit(1);
+    ciphertext = batch ? getFileContents(ciphertext_fd) : getFileData(ciphertext_fd);
+    key = batch ? getFileContents(key_fd) : getFileData(key_fd);
+    if (!ciphertext || !key) {
+        releaseBuffer(ciphertext);
+        ciphertext = NULL;
+        releaseBuffer(key);
+        key = NULL;
+        exit(1);
     }
 
-    initAddressStruct(&server_address, LOCALHOST, atoi(argv[3]));
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    auth = concatenate(DEC_AUTH_MESSAGE, MESSAGE_SEPERATOR);
+    if (batch) {
+        status = (allowedRecords(ciphertext) && allowedRecords(key)) ? 0 : 1;
+        if (status == 0 && !batchRequest(atoi(argv[optind + 2]), DEC_AUTH_MESSAGE, options, ciphertext, key, out_fd, &offset))
+            status = 2;
+        if (output)
+            close(out_fd);
+        else
+            lseek(out_fd, offset, SEEK_SET);
+
+        releaseBuffer(ciphertext);
+        ciphertext = NULL;
+        releaseBuffer(key);
+        key = NULL;
+        exit(status);
+    }
 
-    if (!makeSocketConnection(sock_fd, (struct sockaddr*)&server_address, sizeof(server_address))
-        || !sendMessage(sock_fd, auth) || !authenticated(sock_fd, auth)) {
-            free(ciphertext);
+    if (!allowedChars(ciphertext) || !allowedChars(key)
+        || !sufficientLength(key, strlen(ciphertext))) {
+            releaseBuffer(ciphertext);
             ciphertext = NULL;
-            free(key);
+            releaseBuffer(key);
             key = NULL;
-            free(auth);
-            auth = NULL;
-            exit(2);
+            exit(1);
     }
 
-    ciphertext_sep = concatenate(ciphertext, MESSAGE_SEPERATOR);
-    message = concatenate(ciphertext_sep, key);
-    message_term = concatenate(message, MESSAGE_TERMINATOR);
-    sendMessage(sock_fd, message_term);
-
-    plaintext = getResponse(sock_fd);
-    close(sock_fd);
-    puts(plaintext);
+    len = strlen(ciphertext);
+    status = (parallelRequest(atoi(argv[optind + 2]), DEC_AUTH_MESSAGE, options, ciphertext, key, len, connections, out_fd, offset)
+        && writeAt(out_fd, FILE_TERMINATOR, strlen(FILE_TERMINATOR), offset + len)) ? 0 : 2;
+    if (output)
+        close(out_fd);
+    else
+        lseek(out_fd, offset + len + strlen(FILE_TERMINATOR), SEEK_SET);
 
-    free(ciphertext);
+    releaseBuffer(ciphertext);
     ciphertext = NULL;
-    free(ciphertext_sep);
-    ciphertext_sep = NULL;
-    free(key);
+    releaseBuffer(key);
     key = NULL;
-    free(message);
-    message = NULL;
-    free(message_term);
-    message_term = NULL;
-    free(auth);
-    auth = NULL;
-    free(plaintext);
-    plaintext = NULL;
-    exit(0);
+    exit(status);
 }
\ No newline at end of file
@@ -1,7 +1,15 @@
 #ifndef __DEC_SERVER_H__
 #define __DEC_SERVER_H__
 
-char* decryptMessage(const char*, const char*, char*);
-void handleConnection(int);
+struct lanes;
+struct trace;
+
+void decryptChunked(const char*, const char*, char*, long, int);
+char* decryptMessage(const char*, const char*, char*, long);
+unsigned char* decryptPacked(const unsigned char*, const unsigned char*, unsigned char*, long);
+void handleBatchRequest(int, int, struct lanes*, struct trace*);
+void handleConnection(int, struct lanes*, struct trace*);
+void handlePackedRequest(int, int, struct lanes*, struct trace*);
+int respondBatch(int, int, struct lanes*, struct trace*);
 
 #endif /* __DEC_SERVER_H__ */
\ No newline at end of file
@@ -10,88 +10,135 @@
  * 
  * Arguments are first verified before an attempt to connect to the server is
  * made. Once connection is authenticated, plaintext and key are sent to be
- * encrypted. Resulting ciphertext is then sent to standard output.
+ * encrypted, packed into 5-bit symbols if requested and accepted by the server.
+ * Requests and responses may also be checked against CRC32C trailers.
+ * Resulting ciphertext is streamed to standard output or the output file.
+ * 
+ * In batch mode, every line of the plaintext file is a record sent along with
+ * the line of the key file at the same position, with records grouped into
+ * batch frames; each resulting line of ciphertext is output in order.
+ * 
+ * Given an output file, plaintext and key may instead be split into aligned
+ * ranges sent over up to the given number of parallel connections, with each
+ * range of ciphertext written in place to the output file.
  */
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <plaintext file> <key file> <port>\n", argv[0]);
+    char* output;
+    int batch;
+    int connections;
+    int options;
+    int opt;
+
+    output = NULL;
+    batch = 0;
+    connections = 1;
+    options = 0;
+    while ((opt = getopt(argc, argv, "bcj:o:p")) != -1) {
+        switch (opt) {
+            case 'b':
+                batch = 1;
+                break;
+            case 'c':
+                options |= OPTION_CHECKSUM;
+                break;
+            case 'j':
+                connections = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'p':
+                options |= OPTION_PACKED;
+                break;
+            default:
+                connections = 0;
+                break;
+        }
+    }
+    if (argc - optind != 3 || connections <= 0 || (connections > 1 && (!output || batch))) {
+        fprintf(stderr, "Usage: %s [-b | -o output file -j connections] [-c] [-p] <plaintext file> <key file> <port>\n", argv[0]);
         exit(1);
     }
-    
+
     char* cwd;
     char* plaintext;
-    char* plaintext_sep;
     char* key;
-    char* auth;
-    char* message;
-    char* message_term;
-    char* ciphertext;
     int plaintext_fd;
     int key_fd;
-    int sock_fd;
-    struct sockaddr_in server_address;
+    int out_fd;
+    int status;
+    long len;
+    off_t offset;
 
     cwd = (char*)calloc(PATH_BUFFER_SIZE, sizeof(char));
     getcwd(cwd, PATH_BUFFER_SIZE);
 
-    plaintext_fd = getFileDesc(cwd, argv[1]);
-    key_fd = getFileDesc(cwd, argv[2]);
+    plaintext_fd = getFileDesc(cwd, argv[optind]);
+    key_fd = getFileDesc(cwd, argv[optind + 1]);
+    out_fd = output ? createFileDesc(cwd, output) : STDOUT_FILENO;
 
     free(cwd);
     cwd = NULL;
 
     if (!locatedFile(plaintext_fd) || !locatedFile(key_fd))
         exit(1);
+    if (out_fd < 0) {
+        perror("open()");
+        exit(1);
+    }
 
-    plaintext = getFileData(plaintext_fd);
-    key = getFileData(key_fd);
+    // Standard output may be a file shared with other writers, so output
+    // starts wherever its file position was left
+    offset = output ? 0 : lseek(out_fd, 0, SEEK_CUR);
+    if (offset < 0)
+        offset = 0;
 
-    if (!allowedChars(plaintext) || !allowedChars(key)
-        || !sufficientLength(key, strlen(plaintext))) {
-            free(plaintext);
-            plaintext = NULL;
-            free(key);
-            key = NULL;
-            exit(1);
+    plaintext = batch ? getFileContents(plaintext_fd) : getFileData(plaintext_fd);
+    key = batch ? getFileContents(key_fd) : getFileData(key_fd);
+    if (!plaintext || !key) {
+        releaseBuffer(plaintext);
+        plaintext = NULL;
+        releaseBuffer(key);
+        key = NULL;
+        exit(1);
     }
 
-    initAddressStruct(&server_address, LOCALHOST, atoi(argv[3]));
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    auth = concatenate(ENC_AUTH_MESSAGE, MESSAGE_SEPERATOR);
+    if (batch) {
+        status = (allowedRecords(plaintext) && allowedRecords(key)) ? 0 : 1;
+        if (status == 0 && !batchRequest(atoi(argv[optind + 2]), ENC_AUTH_MESSAGE, options, plaintext, key, out_fd, &offset))
+            status = 2;
+        if (output)
+            close(out_fd);
+        else
+            lseek(out_fd, offset, SEEK_SET);
+
+        releaseBuffer(plaintext);
+        plaintext = NULL;
+        releaseBuffer(key);
+        key = NULL;
+        exit(status);
+    }
 
-    if (!makeSocketConnection(sock_fd, (struct sockaddr*)&server_address, sizeof(server_address))
-        || !sendMessage(sock_fd, auth) || !authenticated(sock_fd, auth)) {
-            free(plaintext);
+    if (!allowedChars(plaintext) || !allowedChars(key)
+        || !sufficientLength(key, strlen(plaintext))) {
+            releaseBuffer(plaintext);
             plaintext = NULL;
-            free(key);
+            releaseBuffer(key);
             key = NULL;
-            free(auth);
-            auth = NULL;
-            exit(2);
+            exit(1);
     }
 
-    plaintext_sep = concatenate(plaintext, MESSAGE_SEPERATOR);
-    message = concatenate(plaintext_sep, key);
-    message_term = concatenate(message, MESSAGE_TERMINATOR);
-    sendMessage(sock_fd, message_term);
-
-    ciphertext = getResponse(sock_fd);
-    close(sock_fd);
-    puts(ciphertext);
+    len = strlen(plaintext);
+    status = (parallelRequest(atoi(argv[optind + 2]), ENC_AUTH_MESSAGE, options, plaintext, key, len, connections, out_fd, offset)
+        && writeAt(out_fd, FILE_TERMINATOR, strlen(FILE_TERMINATOR), offset + len)) ? 0 : 2;
+    if (output)
+        close(out_fd);
+    else
+        lseek(out_fd, offset + len + strlen(FILE_TERMINATOR), SEEK_SET);
 
-    free(plaintext);
+    releaseBuffer(plaintext);
     plaintext = NULL;
-    free(plaintext_sep);
-    plaintext_sep = NULL;
-    free(key);
+    releaseBuffer(key);
     key = NULL;
-    free(message);
-    message = NULL;
-    free(message_term);
-    message_term = NULL;
-    free(auth);
-    auth = NULL;
-    free(ciphertext);
-    ciphertext = NULL;
-    exit(0);
+    exit(status);
 }
\ No newline at end of file
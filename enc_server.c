@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,12 +15,55 @@
  * Server is started up by binding and listening at the given port for
  * connection attempts which are then handed off to child processes for client
  * authentication, message reception, and encryption.
+ * 
+ * Workers may be pinned to a single CPU each, and listening may be sharded
+ * into one listener per NUMA node sharing the port, each with its workers
+ * confined to the node. Benchmark mode instead reports the throughput of
+ * workers with and without pinning.
+ * 
+ * On SIGHUP, the listening socket is handed over to a new server started from
+ * the same command line; once it is ready, this one stops accepting, waits for
+ * its workers to finish and exits.
+ * 
+ * Given a trace file, the size, options, timing, connection and outcome of
+ * every request answered or dropped are appended to it for otp_replay.
  */
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    char* trace_path;
+    int benchmark;
+    int pinned;
+    int sharded;
+    int opt;
+
+    trace_path = NULL;
+    benchmark = 0;
+    pinned = 0;
+    sharded = 0;
+    while ((opt = getopt(argc, argv, "abst:")) != -1) {
+        switch (opt) {
+            case 'a':
+                pinned = 1;
+                break;
+            case 'b':
+                benchmark = 1;
+                break;
+            case 's':
+                sharded = 1;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            default:
+                benchmark = -1;
+                break;
+        }
+    }
+    if (benchmark < 0 || (!benchmark && argc - optind != 1)) {
+        fprintf(stderr, "Usage: %s [-a] [-s] [-t trace file] <port> | %s -b\n", argv[0], argv[0]);
         exit(1);
     }
+    if (benchmark)
+        exit(benchmarkAffinity(encryptChunked) ? 0 : 2);
 
     int sock_fd;
     int client_sock_fd;
@@ -25,20 +71,47 @@ int main(int argc, char* argv[]) {
     struct sockaddr_in address, client_address;
     socklen_t client_address_size;
     pid_t pid;
+    struct serverStats stats;
+    struct lanes lanes;
+    struct trace trace;
+    cpu_set_t nodes[MAX_NUMA_NODES];
+    cpu_set_t cpus;
 
-    initAddressStruct(&address, LOCALHOST, atoi(argv[1]));
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (!installStatsHandler() || !installReloadHandler())
+        exit(2);
+    if (sharded && shardListeners(nodes, getNodeCpus(nodes, MAX_NUMA_NODES)) < 0)
+        exit(2);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+        CPU_ZERO(&cpus);
+
+    initAddressStruct(&address, LOCALHOST, atoi(argv[optind]));
     client_address_size = sizeof(client_address);
     num_processes = 0;
+    memset(&stats, '\0', sizeof(stats));
+    memset(&trace, '\0', sizeof(trace));
+    trace.fd = -1;
 
-    if (!connectSocket(sock_fd, (struct sockaddr*)&address))
+    if (!inheritListener(&sock_fd)) {
+        sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if ((sharded && !setReusePort(sock_fd)) || !connectSocket(sock_fd, (struct sockaddr*)&address))
+            exit(2);
+    }
+    if (!initLanes(&lanes) || (trace_path && !openTrace(&trace, trace_path, OTP_ENCRYPT)))
         exit(2);
+    signalReady();
     
     while (1) {
-        do {
-            if (waitpid(-1, NULL, WNOHANG) > 0)
-                num_processes--;
-        } while (num_processes > MAX_CONCURRENT_PROCESSES);
+        num_processes -= reapWorkers(&stats, &lanes, !admitWorker(&lanes, num_processes));
+        if (statsRequested())
+            printStats(&stats);
+        if (reloadRequested()) {
+            if (sharded)
+                fprintf(stderr, "Reloading is not supported for sharded servers\n");
+            else if (reloadServer(sock_fd, argv))
+                break;
+        }
+        if (!admitWorker(&lanes, num_processes) || !awaitConnection(sock_fd, &lanes))
+            continue;
 
         client_sock_fd = connectClient(
             sock_fd, (struct sockaddr*)&address, &client_address_size
@@ -50,89 +123,332 @@ int main(int argc, char* argv[]) {
                     perror("fork()");
                     break;
                 case 0:
-                    handleConnection(client_sock_fd);
+                    close(sock_fd);
+                    if (pinned)
+                        pinWorker(&cpus, stats.accepted);
+                    trace.connection = getpid();
+                    trace.concurrency = num_processes + 1;
+                    handleConnection(client_sock_fd, &lanes, &trace);
                     break;
                 default:
                     num_processes++;
+                    stats.accepted++;
                     break;
             }
+            close(client_sock_fd);
         }
     }
+
+    // The new server accepts from here on, including connections already
+    // queued on the socket, while workers in flight finish their requests
     close(sock_fd);
+    while (num_processes > 0)
+        num_processes -= reapWorkers(&stats, &lanes, 1);
     exit(0);
 }
 
 /**
- * Combines plaintext and key to create an encrypted message.
+ * Encrypts len characters of plaintext, or len symbols if packed, with key in
+ * chunks of BULK_CHUNK_SIZE, yielding the processor between chunks so bulk
+ * requests give way to small ones.
  */
-char* encryptMessage(const char* plaintext, const char* key, char* buffer) {
-    int i;
+void encryptChunked(const char* plaintext, const char* key, char* buffer, long len, int packed) {
+    long i;
+    long n;
+    long offset;
+
+    for (i = 0; i < len; i += n) {
+        n = (len - i < BULK_CHUNK_SIZE) ? len - i : BULK_CHUNK_SIZE;
+        offset = packed ? packedSize(i) : i;
+        if (packed)
+            encryptPacked((const unsigned char*)&plaintext[offset], (const unsigned char*)&key[offset], (unsigned char*)&buffer[offset], n);
+        else
+            encryptMessage(&plaintext[offset], &key[offset], &buffer[offset], n);
+        if (i + n < len)
+            sched_yield();
+    }
+}
+
+/**
+ * Combines len characters of plaintext and key to create an encrypted message.
+ */
+char* encryptMessage(const char* plaintext, const char* key, char* buffer, long len) {
+    long i;
     int j;
     int k;
     int ciphered;
 
-    i = 0;
-    while (plaintext[i]) {
+    for (i = 0; i < len; i++) {
         // 26 is space character in ALLOWED_CHARS
         j = (plaintext[i] != ' ') ? plaintext[i] - 65 : 26;  
         k = (key[i] != ' ') ? key[i] - 65 : 26;
         ciphered = (j + k) % sizeof(ALLOWED_CHARS);
-        buffer[i++] = ALLOWED_CHARS[ciphered];
+        buffer[i] = ALLOWED_CHARS[ciphered];
     }
     return buffer;
 }
 
+/**
+ * Combines len packed symbols of plaintext and key to create a packed encrypted
+ * message.
+ */
+unsigned char* encryptPacked(const unsigned char* plaintext, const unsigned char* key, unsigned char* buffer, long len) {
+    shiftPacked(plaintext, key, buffer, len, 0);
+    return buffer;
+}
+
+/**
+ * Handles batch request messages.
+ * 
+ * Frames are answered by respondBatch() one after another for as long as a
+ * keep-alive client keeps sending them within KEEPALIVE_TIMEOUT seconds, with
+ * the worker out of the small lane while it waits; otherwise socket
+ * connection is closed after the first.
+ */
+void handleBatchRequest(int sock_fd, int options, struct lanes* lanes, struct trace* trace) {
+    int status;
+
+    if (options & OPTION_KEEPALIVE)
+        setNoDelay(sock_fd);
+    status = 0;
+    do {
+        if ((options & OPTION_KEEPALIVE) && !awaitRequest(sock_fd, lanes))
+            break;
+        status = respondBatch(sock_fd, options, lanes, trace);
+    } while (status == 0 && (options & OPTION_KEEPALIVE));
+    close(sock_fd);
+    _exit(status);
+}
+
 /**
  * Handles client connection.
  * 
  * Client is first authenticated before getting response message composed of
  * plaintext and key to be used for encryption; resulting encrypted message is
  * sent back to client and socket connection is closed.
+ * 
+ * Clients requesting the batch or packed options are handed off to
+ * handleBatchRequest() or handlePackedRequest() once acknowledged; the
+ * keep-alive option is only accepted along with batch frames.
+ * 
+ * The handshake runs against its own deadline, while the request body and
+ * response, which may be of any size, are only held to a minimum throughput,
+ * so a stalled or trickling client cannot hold on to a worker; the exit status
+ * tells the server whether the worker timed out. The worker moves into the
+ * bulk lane as soon as BULK_THRESHOLD bytes of the request have arrived, or a
+ * packed or batch header declares as many characters.
+ * 
+ * With the crc option, request and response are each followed by a CRC32C
+ * trailer computed as their bytes pass through, and requests failing the
+ * check are dropped.
  */
-void handleConnection(int sock_fd) {
+void handleConnection(int sock_fd, struct lanes* lanes, struct trace* trace) {
     char* auth;
     char* response;
     char* plaintext;
     char* key;
     char* ciphertext;
-    char* ciphertext_term;
-    int plaintext_len;
-    int key_len;
+    long plaintext_len;
+    int options;
+    int status;
+    struct iovec iov[2];
+    struct transfer transfer;
 
-    if (!authenticate(sock_fd, ENC_AUTH_MESSAGE)) {
+    beginTrace(trace);
+    beginTransfer(&transfer, HANDSHAKE_TIMEOUT, 0);
+    options = 0;
+    if (!authenticate(sock_fd, ENC_AUTH_MESSAGE, &transfer, &options)) {
+        status = failureStatus();
+        traceRequest(trace, 0, 0, options, status);
         auth = concatenate(NAK, MESSAGE_TERMINATOR);
-        sendMessage(sock_fd, auth);
+        sendMessage(sock_fd, auth, NULL);
         close(sock_fd);
 
         free(auth);
         auth = NULL;
-        _exit(2);
+        _exit(status);
     }
-    auth = concatenate(ACK, MESSAGE_SEPERATOR);
-    sendMessage(sock_fd, auth);
+    if (!(options & OPTION_BATCH))
+        options &= ~OPTION_KEEPALIVE;
+    auth = createHandshake(ACK, options);
+    sendMessage(sock_fd, auth, NULL);
+    if (options & OPTION_BATCH)
+        handleBatchRequest(sock_fd, options, lanes, trace);
+    if (options & OPTION_PACKED)
+        handlePackedRequest(sock_fd, options, lanes, trace);
 
-    response = getResponse(sock_fd);
+    beginTrace(trace);
+    beginTransfer(&transfer, 0, MIN_THROUGHPUT);
+    transfer.checksum = options & OPTION_CHECKSUM;
+    response = getResponse(sock_fd, &transfer, lanes);
+    if (!response) {
+        status = failureStatus();
+        traceRequest(trace, transfer.bytes, 0, options, status);
+        close(sock_fd);
+        _exit(status);
+    }
     plaintext_len = getTextLength(response);
-    plaintext = (char*)calloc(plaintext_len + 1, sizeof(char));
-    getText(response, plaintext);
+    if (!response[plaintext_len] || getKeyLength(response) < plaintext_len || !verifyChecksum(&transfer)) {
+        traceRequest(trace, plaintext_len, 0, options, 2);
+        close(sock_fd);
+        releaseBuffer(response);
+        response = NULL;
+        _exit(2);
+    }
+    plaintext = response;
+    key = &response[plaintext_len + 1];
+
+    ciphertext = allocBuffer(plaintext_len + 1);
+    encryptChunked(plaintext, key, ciphertext, plaintext_len, 0);
+    iov[0].iov_base = ciphertext;
+    iov[0].iov_len = plaintext_len;
+    iov[1].iov_base = (char*)MESSAGE_TERMINATOR;
+    iov[1].iov_len = strlen(MESSAGE_TERMINATOR);
+    beginTransfer(&transfer, 0, MIN_THROUGHPUT);
+    transfer.checksum = options & OPTION_CHECKSUM;
+    status = (sendVector(sock_fd, iov, 2, &transfer) && sendChecksum(sock_fd, &transfer)) ? 0 : failureStatus();
+    close(sock_fd);
+    traceRequest(trace, plaintext_len, 0, options, status);
+
+    releaseBuffer(response);
+    response = NULL;
+    releaseBuffer(ciphertext);
+    ciphertext = NULL;
+    _exit(status);
+}
 
-    key_len = getKeyLength(response);
-    key = (char*)calloc(key_len + 1, sizeof(char));
-    getKey(response, key);
+/**
+ * Handles a packed request message.
+ * 
+ * The symbol count, of at most MAX_PACKED_LENGTH, is received first, followed
+ * by packed plaintext and key to be used for encryption; resulting packed
+ * ciphertext is sent back to client and socket connection is closed.
+ */
+void handlePackedRequest(int sock_fd, int options, struct lanes* lanes, struct trace* trace) {
+    unsigned char* plaintext;
+    unsigned char* key;
+    unsigned char* ciphertext;
+    long len;
+    long size;
+    int status;
+    struct transfer transfer;
 
-    ciphertext = (char*)calloc(plaintext_len + 1, sizeof(char));
-    encryptMessage(plaintext, key, ciphertext);
-    ciphertext_term = concatenate(ciphertext, MESSAGE_TERMINATOR);
-    sendMessage(sock_fd, ciphertext_term);
+    beginTrace(trace);
+    beginTransfer(&transfer, 0, MIN_THROUGHPUT);
+    transfer.checksum = options & OPTION_CHECKSUM;
+    len = getFrameLength(sock_fd, &transfer);
+    if (len > MAX_PACKED_LENGTH) {
+        fprintf(stderr, "handlePackedRequest(): Request exceeds %d symbols\n", MAX_PACKED_LENGTH);
+        traceRequest(trace, 0, 0, options, 2);
+        close(sock_fd);
+        _exit(2);
+    }
+    if (len >= BULK_THRESHOLD && !enterBulkLane(lanes, &transfer)) {
+        status = failureStatus();
+        traceRequest(trace, len, 0, options, status);
+        close(sock_fd);
+        _exit(status);
+    }
+    size = packedSize(len);
+    plaintext = (len >= 0) ? (unsigned char*)recvBuffer(sock_fd, size, &transfer) : NULL;
+    key = plaintext ? (unsigned char*)recvBuffer(sock_fd, size, &transfer) : NULL;
+
+    if (!key || !recvChecksum(sock_fd, &transfer)) {
+        status = failureStatus();
+        traceRequest(trace, (len > 0) ? len : 0, 0, options, status);
+        close(sock_fd);
+        _exit(status);
+    }
+
+    ciphertext = (unsigned char*)allocBuffer(size + 1);
+    encryptChunked((char*)plaintext, (char*)key, (char*)ciphertext, len, 1);
+    beginTransfer(&transfer, 0, MIN_THROUGHPUT);
+    transfer.checksum = options & OPTION_CHECKSUM;
+    status = (sendData(sock_fd, (char*)ciphertext, size, &transfer) && sendChecksum(sock_fd, &transfer)) ? 0 : failureStatus();
     close(sock_fd);
+    traceRequest(trace, len, 0, options, status);
+
+    releaseBuffer((char*)plaintext);
+    plaintext = NULL;
+    releaseBuffer((char*)key);
+    key = NULL;
+    releaseBuffer((char*)ciphertext);
+    ciphertext = NULL;
+    _exit(status);
+}
+
+/**
+ * Answers one batch request frame.
+ * 
+ * The record count and table of record end offsets are received first,
+ * followed by the plaintext and key of every record laid out back to back,
+ * packed if the packed option was accepted. All records are encrypted in a
+ * single pass and the count, table and resulting ciphertext are sent back to
+ * client. Returns 0 on success or the exit status describing the failure.
+ */
+int respondBatch(int sock_fd, int options, struct lanes* lanes, struct trace* trace) {
+    char header[AUTH_BUFFER_SIZE];
+    char* plaintext;
+    char* key;
+    char* ciphertext;
+    uint32_t* ends;
+    long count;
+    long total;
+    long size;
+    int status;
+    struct iovec iov[3];
+    struct transfer transfer;
+
+    beginTrace(trace);
+    beginTransfer(&transfer, 0, MIN_THROUGHPUT);
+    transfer.checksum = options & OPTION_CHECKSUM;
+    total = 0;
+    count = getFrameLength(sock_fd, &transfer);
+    ends = (count >= 0 && count <= MAX_BATCH_RECORDS)
+        ? (uint32_t*)malloc(count * sizeof(uint32_t) + 1) : NULL;
+    if (!ends || !recvAll(sock_fd, (char*)ends, count * sizeof(uint32_t), &transfer)
+        || (total = batchSize(ends, count)) < 0
+        || (total >= BULK_THRESHOLD && !enterBulkLane(lanes, &transfer))) {
+            status = failureStatus();
+            traceRequest(trace, (total > 0) ? total : 0, (count > 0 && count <= MAX_BATCH_RECORDS) ? count : 0,
+                options, status);
+            free(ends);
+            ends = NULL;
+            return status;
+    }
+
+    size = (options & OPTION_PACKED) ? packedSize(total) : total;
+    plaintext = recvBuffer(sock_fd, size, &transfer);
+    key = plaintext ? recvBuffer(sock_fd, size, &transfer) : NULL;
+    ciphertext = NULL;
+    status = 0;
+    if (!key || !recvChecksum(sock_fd, &transfer) || !(ciphertext = allocBuffer(size + 1)))
+        status = failureStatus();
+
+    if (status == 0) {
+        encryptChunked(plaintext, key, ciphertext, total, options & OPTION_PACKED);
+
+        snprintf(header, sizeof(header), "%ld%s", count, MESSAGE_SEPERATOR);
+        iov[0].iov_base = header;
+        iov[0].iov_len = strlen(header);
+        iov[1].iov_base = ends;
+        iov[1].iov_len = count * sizeof(uint32_t);
+        iov[2].iov_base = ciphertext;
+        iov[2].iov_len = size;
+        beginTransfer(&transfer, 0, MIN_THROUGHPUT);
+        transfer.checksum = options & OPTION_CHECKSUM;
+        if (!sendVector(sock_fd, iov, 3, &transfer) || !sendChecksum(sock_fd, &transfer))
+            status = failureStatus();
+    }
+    traceRequest(trace, total, count, options, status);
 
-    free(plaintext);
+    releaseBuffer(plaintext);
     plaintext = NULL;
-    free(key);
+    releaseBuffer(key);
     key = NULL;
-    free(ciphertext);
+    releaseBuffer(ciphertext);
     ciphertext = NULL;
-    free(ciphertext_term);
-    ciphertext_term = NULL;
-    _exit(0);
+    free(ends);
+    ends = NULL;
+    return status;
 }
\ No newline at end of file
@@ -1,7 +1,15 @@
 #ifndef __ENC_SERVER_H__
 #define __ENC_SERVER_H__
 
-char* encryptMessage(const char*, const char*, char*);
-void handleConnection(int);
+struct lanes;
+struct trace;
+
+void encryptChunked(const char*, const char*, char*, long, int);
+char* encryptMessage(const char*, const char*, char*, long);
+unsigned char* encryptPacked(const unsigned char*, const unsigned char*, unsigned char*, long);
+void handleBatchRequest(int, int, struct lanes*, struct trace*);
+void handleConnection(int, struct lanes*, struct trace*);
+void handlePackedRequest(int, int, struct lanes*, struct trace*);
+int respondBatch(int, int, struct lanes*, struct trace*);
 
 #endif /* __ENC_SERVER_H__ */
\ No newline at end of file
@@ -1,16 +1,30 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
 #include "keygen.h"
 #include "libotp.h"
 
 /**
  * Creates a secret key based on the length argument and the allowed character
  * set before sending it to standard output.
+ * 
+ * Serve mode instead runs a daemon keeping a pool of pad topped up and handing
+ * keys out of it over a local socket, and socket mode gets a key from one.
  */
 int main(int argc, char* argv[]) {
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0)
+        return serveKeys(argv[2]) ? 0 : 2;
+    if (argc == 4 && strcmp(argv[1], "--socket") == 0 && atol(argv[3]) > 0)
+        return requestKey(argv[2], atol(argv[3])) ? 0 : 2;
     if (argc != 2 || atoi(argv[1]) <= 0) {
-        fprintf(stderr, "Usage: %s <length>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <length> | %s --serve <socket path> | %s --socket <socket path> <length>\n",
+            argv[0], argv[0], argv[0]);
         return 1;
     }
 
@@ -19,6 +33,8 @@ int main(int argc, char* argv[]) {
 
     len = atoi(argv[1]);
     key = generateKey(len);
+    if (!key)
+        return 2;
     printf("%s", key);
 
     free(key);
@@ -26,9 +42,42 @@ int main(int argc, char* argv[]) {
     return 0;
 }
 
+/**
+ * Fills buffer with len characters from the allowed character set, each
+ * chosen from bytes drawn with getrandom(). Returns 1 on success.
+ */
+int fillKey(char* buffer, long len) {
+    unsigned char random[RANDOM_BUFFER_SIZE];
+    unsigned char limit;
+    ssize_t bytes;
+    ssize_t j;
+    long i;
+
+    // Bytes past the last whole multiple of the character set are discarded
+    // so that every character is equally likely
+    limit = 256 / sizeof(ALLOWED_CHARS) * sizeof(ALLOWED_CHARS);
+    i = 0;
+    while (i < len) {
+        bytes = getrandom(random, (len - i < sizeof(random)) ? len - i : sizeof(random), 0);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0) {
+            perror("getrandom()");
+            return 0;
+        }
+        for (j = 0; j < bytes; j++) {
+            if (random[j] < limit)
+                buffer[i++] = ALLOWED_CHARS[random[j] % sizeof(ALLOWED_CHARS)];
+        }
+    }
+
+    memset(random, '\0', sizeof(random));
+    return 1;
+}
+
 /**
  * Creates a secret key of size len composed of characters from the allowed
- * character set, each chosen using rand(), followed by a newline character.
+ * character set, each chosen using fillKey(), followed by a newline character.
  */
 char* generateKey(int len) {
     if (len <= 0) {
@@ -37,19 +86,365 @@ char* generateKey(int len) {
     }
 
     char* buffer;
-    char c;
-    int i;
-    int num;
 
-    srand(time(NULL));
     buffer = (char*)calloc(len + 2, sizeof(char));
-    i = 0;
-    
-    while (i < len) {
-        num = rand() % sizeof(ALLOWED_CHARS);
-        c = ALLOWED_CHARS[num];
-        buffer[i++] = c;
+    if (!buffer || !fillKey(buffer, len)) {
+        free(buffer);
+        buffer = NULL;
+        return NULL;
     }
-    buffer[i] = '\n';
+    buffer[len] = '\n';
     return buffer;
-}
\ No newline at end of file
+}
+
+/**
+ * Initializes a sockaddr_un structure for the local socket at path.
+ */
+int initLocalAddress(struct sockaddr_un* address, const char* path) {
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "initLocalAddress(): Socket path is too long\n");
+        return 0;
+    }
+    memset(address, '\0', sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return 1;
+}
+
+/**
+ * Sends as much of the key being issued to client as the connection determined
+ * by the socket file descriptor takes without blocking.
+ * 
+ * Characters are taken out of the pool a chunk at a time and wiped from the
+ * pad, so that they are never issued again, then wiped from the chunk once
+ * sent. Whatever the pool is short of is generated on the spot. Returns 1
+ * unless the connection failed.
+ */
+int issueKey(struct keyPool* pool, struct keyClient* client, int sock_fd) {
+    ssize_t sent;
+    long first;
+    long taken;
+    long len;
+
+    while (keyPending(client)) {
+        if (client->chunk_len == 0) {
+            len = (client->remaining < KEY_SEND_CHUNK) ? client->remaining : KEY_SEND_CHUNK;
+            taken = (len < pool->length) ? len : pool->length;
+            first = (taken < pool->size - pool->start) ? taken : pool->size - pool->start;
+            memcpy(client->chunk, &pool->pad[pool->start], first);
+            memcpy(&client->chunk[first], pool->pad, taken - first);
+            memset(&pool->pad[pool->start], '\0', first);
+            memset(pool->pad, '\0', taken - first);
+            if (len > taken) {
+                if (!fillKey(&client->chunk[taken], len - taken))
+                    return 0;
+                pool->shortfall += len - taken;
+            }
+
+            if (pool->length == pool->size && taken > 0)
+                clock_gettime(CLOCK_MONOTONIC, &pool->drained);
+            pool->start = (pool->start + taken) % pool->size;
+            pool->length -= taken;
+            client->remaining -= len;
+            client->chunk_start = 0;
+            client->chunk_len = len;
+        }
+
+        sent = send(sock_fd, &client->chunk[client->chunk_start], client->chunk_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        memset(&client->chunk[client->chunk_start], '\0', sent);
+        client->chunk_start += sent;
+        client->chunk_len -= sent;
+        clock_gettime(CLOCK_MONOTONIC, &client->progress);
+    }
+    return 1;
+}
+
+/**
+ * Determines if client has a key partly issued.
+ */
+int keyPending(const struct keyClient* client) {
+    return client->remaining > 0 || client->chunk_len > 0;
+}
+
+/**
+ * Writes the counters of the pool to standard error, along with the rate at
+ * which it has issued key characters.
+ */
+void printPoolStats(const struct keyPool* pool) {
+    long uptime;
+
+    uptime = elapsedMs(&pool->started);
+    fprintf(stderr, "keys: %ld, bytes: %ld, %.1f MB/s, pool: %ld/%ld, shortfall: %ld, refill lag: %ld ms last, %ld ms max\n",
+        pool->issued, pool->bytes, uptime > 0 ? pool->bytes / 1000.0 / uptime : 0.0,
+        pool->length, pool->size, pool->shortfall, pool->last_lag, pool->max_lag);
+}
+
+/**
+ * Generates up to len characters into the free space of the pool, recording
+ * the refill lag once it is full again.
+ */
+void refillPool(struct keyPool* pool, long len) {
+    long end;
+
+    end = (pool->start + pool->length) % pool->size;
+    if (len > pool->size - pool->length)
+        len = pool->size - pool->length;
+    if (len > pool->size - end)
+        len = pool->size - end;
+    if (!fillKey(&pool->pad[end], len))
+        return;
+    pool->length += len;
+
+    if (len > 0 && pool->length == pool->size) {
+        pool->last_lag = elapsedMs(&pool->drained);
+        if (pool->last_lag > pool->max_lag)
+            pool->max_lag = pool->last_lag;
+    }
+}
+
+/**
+ * Releases the chunk of client, wiping whatever part of a key it still holds.
+ */
+void releaseKeyClient(struct keyClient* client) {
+    if (client->chunk)
+        memset(client->chunk, '\0', KEY_SEND_CHUNK);
+    free(client->chunk);
+    client->chunk = NULL;
+}
+
+/**
+ * Gets a key of len characters from the key daemon listening at path and
+ * sends it to standard output followed by a newline character.
+ */
+int requestKey(const char* path, long len) {
+    struct sockaddr_un address;
+    struct transfer transfer;
+    char header[AUTH_BUFFER_SIZE];
+    char* key;
+    int sock_fd;
+    int ret;
+
+    if (len > MAX_KEY_LENGTH) {
+        fprintf(stderr, "requestKey(): Key length exceeds %d\n", MAX_KEY_LENGTH);
+        return 0;
+    }
+    if (!initLocalAddress(&address, path))
+        return 0;
+    key = allocBuffer(len + 2);
+    if (!key)
+        return 0;
+
+    sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    snprintf(header, sizeof(header), "%ld%s", len, MESSAGE_SEPERATOR);
+    beginTransfer(&transfer, 0, MIN_THROUGHPUT);
+    ret = makeSocketConnection(sock_fd, (struct sockaddr*)&address, sizeof(address))
+        && sendMessage(sock_fd, header, NULL) && recvAll(sock_fd, key, len, &transfer);
+    close(sock_fd);
+
+    if (ret) {
+        key[len] = '\n';
+        ret = fwrite(key, 1, len + 1, stdout) == len + 1;
+    } else {
+        fprintf(stderr, "requestKey(): Key was not received\n");
+    }
+
+    releaseBuffer(key);
+    key = NULL;
+    return ret;
+}
+
+/**
+ * Serves client as far as the connection determined by the socket file
+ * descriptor allows without blocking.
+ * 
+ * Unless a key is already partly issued, whatever part of the next request has
+ * arrived is received first, and the key is started once its length is
+ * complete. The key is then sent with issueKey(). Returns 0 if the client
+ * closed the connection, failed or sent an invalid request.
+ */
+int serveKeyClient(struct keyPool* pool, struct keyClient* client, int sock_fd) {
+    ssize_t received;
+    int started;
+
+    if (!keyPending(client)) {
+        started = startKey(pool, client);
+        if (started == 0) {
+            received = recv(sock_fd, &client->header[client->header_len],
+                KEY_HEADER_SIZE - client->header_len, MSG_DONTWAIT);
+            if (received == 0)
+                return 0;
+            if (received < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            client->header_len += received;
+            clock_gettime(CLOCK_MONOTONIC, &client->progress);
+            started = startKey(pool, client);
+        }
+        if (started <= 0)
+            return started == 0;
+    }
+    return issueKey(pool, client, sock_fd);
+}
+
+/**
+ * Runs the key daemon, listening for clients at the local socket path.
+ * 
+ * A pool of KEY_POOL_SIZE characters is generated up front and topped up in
+ * chunks of KEY_REFILL_CHUNK whenever no client is waiting. Clients may stay
+ * connected and ask for any number of keys, each as its length followed by
+ * the message separator, and get back exactly that many characters. Every
+ * client is served without blocking, so one slow client cannot hold up the
+ * others, and a client that has made no progress with a request for
+ * STALL_TIMEOUT seconds is dropped. Sending the daemon SIGUSR1 writes the
+ * pool counters to standard error.
+ */
+int serveKeys(const char* path) {
+    struct keyPool pool;
+    struct keyClient clients[MAX_KEY_CLIENTS + 1];
+    struct pollfd fds[MAX_KEY_CLIENTS + 1];
+    struct sockaddr_un address;
+    struct stat info;
+    int sock_fd;
+    int client_sock_fd;
+    int num_fds;
+    int busy;
+    int ready;
+    int i;
+
+    if (!initLocalAddress(&address, path))
+        return 0;
+    if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+        unlink(path);
+
+    sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        perror("socket()");
+        return 0;
+    }
+    if (bind(sock_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("bind()");
+        return 0;
+    }
+    if (listen(sock_fd, MAX_QUEUE_SIZE) < 0) {
+        perror("listen()");
+        return 0;
+    }
+    if (!installStatsHandler())
+        return 0;
+
+    memset(&pool, '\0', sizeof(pool));
+    pool.size = KEY_POOL_SIZE;
+    pool.pad = allocBuffer(pool.size);
+    if (!pool.pad)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &pool.started);
+    if (!fillKey(pool.pad, pool.size))
+        return 0;
+    pool.length = pool.size;
+
+    fds[0].fd = sock_fd;
+    fds[0].events = POLLIN;
+    num_fds = 1;
+    while (1) {
+        if (statsRequested())
+            printPoolStats(&pool);
+
+        busy = 0;
+        for (i = num_fds - 1; i > 0; i--) {
+            if ((keyPending(&clients[i]) || clients[i].header_len > 0)
+                && elapsedMs(&clients[i].progress) > STALL_TIMEOUT * 1000) {
+                    fprintf(stderr, "serveKeys(): Client stalled\n");
+                    close(fds[i].fd);
+                    releaseKeyClient(&clients[i]);
+                    fds[i] = fds[--num_fds];
+                    clients[i] = clients[num_fds];
+                    continue;
+            }
+            // A client waits to be written to while it has a key partly
+            // issued or a whole request already received
+            fds[i].events = (keyPending(&clients[i])
+                || memchr(clients[i].header, MESSAGE_SEPERATOR[0], clients[i].header_len)) ? POLLOUT : POLLIN;
+            busy |= keyPending(&clients[i]) || clients[i].header_len > 0;
+        }
+
+        // Refilling only happens between polls that find nothing to do, so
+        // waiting clients are never held up by more than one chunk
+        ready = poll(fds, num_fds, (pool.length < pool.size) ? 0 : (busy ? 1000 : -1));
+        if (ready < 0 && errno != EINTR) {
+            perror("poll()");
+            break;
+        }
+        if (ready <= 0) {
+            refillPool(&pool, KEY_REFILL_CHUNK);
+            continue;
+        }
+
+        for (i = num_fds - 1; i > 0; i--) {
+            if (fds[i].revents && !serveKeyClient(&pool, &clients[i], fds[i].fd)) {
+                close(fds[i].fd);
+                releaseKeyClient(&clients[i]);
+                fds[i] = fds[--num_fds];
+                clients[i] = clients[num_fds];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            client_sock_fd = accept(sock_fd, NULL, NULL);
+            if (client_sock_fd < 0) {
+                perror("accept()");
+            } else if (num_fds > MAX_KEY_CLIENTS) {
+                close(client_sock_fd);
+            } else {
+                memset(&clients[num_fds], '\0', sizeof(clients[num_fds]));
+                clients[num_fds].chunk = (char*)malloc(KEY_SEND_CHUNK);
+                if (!clients[num_fds].chunk) {
+                    perror("malloc()");
+                    close(client_sock_fd);
+                    continue;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &clients[num_fds].progress);
+                fds[num_fds].fd = client_sock_fd;
+                fds[num_fds].events = POLLIN;
+                fds[num_fds++].revents = 0;
+            }
+        }
+    }
+
+    close(sock_fd);
+    releaseBuffer(pool.pad);
+    pool.pad = NULL;
+    return 0;
+}
+
+/**
+ * Starts issuing the key asked for by the first whole request received from
+ * client, counting it as issued.
+ * 
+ * Returns 1 if a key was started, 0 if no whole request has been received yet
+ * or -1 if the request is invalid.
+ */
+int startKey(struct keyPool* pool, struct keyClient* client) {
+    char* separator;
+    char* end;
+    long len;
+
+    separator = (char*)memchr(client->header, MESSAGE_SEPERATOR[0], client->header_len);
+    if (!separator && client->header_len < KEY_HEADER_SIZE)
+        return 0;
+    if (separator)
+        *separator = '\0';
+    len = separator ? strtol(client->header, &end, 10) : 0;
+    if (!separator || end != separator || len <= 0 || len > MAX_KEY_LENGTH) {
+        fprintf(stderr, "startKey(): Invalid key request\n");
+        return -1;
+    }
+
+    client->header_len -= separator + 1 - client->header;
+    memmove(client->header, separator + 1, client->header_len);
+    client->remaining = len;
+    pool->issued++;
+    pool->bytes += len;
+    clock_gettime(CLOCK_MONOTONIC, &client->progress);
+    return 1;
+}
@@ -1,6 +1,70 @@
 #ifndef __KEYGEN_H__
 #define __KEYGEN_H__
 
+#include <time.h>
+
+#define KEY_HEADER_SIZE 32
+#define KEY_POOL_SIZE 16777216
+#define KEY_REFILL_CHUNK 65536
+#define KEY_SEND_CHUNK 65536
+#define MAX_KEY_CLIENTS 64
+#define MAX_KEY_LENGTH 1073741824
+#define RANDOM_BUFFER_SIZE 4096
+
+/**
+ * Pad kept topped up by the key daemon, along with its counters.
+ * 
+ * The length characters from start onwards, wrapping around the end of pad,
+ * have been generated but not yet issued. Issued characters are wiped so they
+ * can never be handed out again. drained is when the pool was last drawn down
+ * from full, and refill lag is how long it then took to be full again.
+ */
+struct keyPool {
+    char* pad;
+    long size;
+    long start;
+    long length;
+    long issued;
+    long bytes;
+    long shortfall;
+    long last_lag;
+    long max_lag;
+    struct timespec started;
+    struct timespec drained;
+};
+
+/**
+ * Connection of a client to the key daemon.
+ * 
+ * header holds the header_len bytes of key requests received but not yet
+ * started. remaining is how many characters of the key being issued are still
+ * to be taken from the pool; they pass through chunk, of which the chunk_len
+ * characters from chunk_start onwards are still to be sent. progress is when
+ * the client was last served any bytes.
+ */
+struct keyClient {
+    char header[KEY_HEADER_SIZE];
+    int header_len;
+    char* chunk;
+    long chunk_start;
+    long chunk_len;
+    long remaining;
+    struct timespec progress;
+};
+
+struct sockaddr_un;
+
+int fillKey(char*, long);
 char* generateKey(int);
+int initLocalAddress(struct sockaddr_un*, const char*);
+int issueKey(struct keyPool*, struct keyClient*, int);
+int keyPending(const struct keyClient*);
+void printPoolStats(const struct keyPool*);
+void refillPool(struct keyPool*, long);
+void releaseKeyClient(struct keyClient*);
+int requestKey(const char*, long);
+int serveKeyClient(struct keyPool*, struct keyClient*, int);
+int serveKeys(const char*);
+int startKey(struct keyPool*, struct keyClient*);
 
 #endif /* __KEYGEN_H__ */
\ No newline at end of file
@@ -1,373 +1,3057 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "libotp.h"
 
+static uint32_t (*crc_update)(uint32_t, const unsigned char*, long) = NULL;
+static uint32_t crc_table[256];
+static int notice_fd = -1;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t stats_requested = 0;
+
+static void prefaultPages(char* start, long length);
+
+/**
+ * Maps the symbol in each byte lane of v to its character in the allowed
+ * character set.
+ */
+static uint64_t charLanes(uint64_t v) {
+    // Symbol 26 would land just past 'Z' and is moved down to the space
+    return v + LANE_ASCII - (((v + LANE_HIGH_BITS - LANE_BIAS) & LANE_HIGH_BITS) >> 7) * ('Z' + 1 - ' ');
+}
+
 /**
- * Determines if correct authentication message is received from client.
+ * Parses the handshake reply of the server from the input buffer of conn.
+ * 
+ * Returns 1 once every requested option has been acknowledged, 0 if more of
+ * the reply is still to arrive or -1 if the server refused.
  */
-int authenticate(int sock_fd, char* message) {
+static int completeHandshake(struct otp_conn* conn) {
     char buffer[AUTH_BUFFER_SIZE];
-    int i;
-    int received;
+    char* start;
+    int accepted;
+    long avail;
+    long i;
 
-    memset(buffer, '\0', sizeof(buffer));
-    i = 0;
-    while ((received = recv(sock_fd, &buffer[i], 1, 0)) > 0 && strcmp(&buffer[i], MESSAGE_SEPERATOR) != 0)
-        i += received;
-    buffer[i] = '\0';
-    
-    if (received == -1) {
-        perror("recv()");
-        return 0;
+    start = &conn->in[conn->in_start];
+    avail = conn->in_len - conn->in_start;
+    for (i = 0; i < avail && i < AUTH_BUFFER_SIZE; i++) {
+        if (start[i] == MESSAGE_SEPERATOR[0] || start[i] == MESSAGE_TERMINATOR[0])
+            break;
     }
-
-    if (strcmp(buffer, message) != 0) {
-        fprintf(stderr, "authenticate(): Failed to authenticate client\n");
+    if (i == AUTH_BUFFER_SIZE)
+        return -1;
+    if (i == avail)
         return 0;
+
+    memcpy(buffer, start, i);
+    buffer[i] = '\0';
+    conn->in_start += i + 1;
+    accepted = parseOptions(&buffer[strcspn(buffer, OPTION_SEPERATOR)]);
+    buffer[strcspn(buffer, OPTION_SEPERATOR)] = '\0';
+    if (strcmp(buffer, ACK) != 0 || (accepted & conn->options) != conn->options) {
+        fprintf(stderr, "otp_process(): Failed to be authenticated by server\n");
+        return -1;
     }
+    conn->state = CONN_READY;
     return 1;
 }
 
 /**
- * Determines if authentication confirmation message is received from server.
+ * Parses the response to the oldest pending request from the input buffer of
+ * conn and hands its result to the request's callback.
+ * 
+ * Returns 1 if a request was completed, 0 if its response is still to arrive
+ * or -1 if the response does not match the request.
  */
-int authenticated(int sock_fd, char* auth) {
-    char buffer[AUTH_BUFFER_SIZE];
-    int i;
-    int received;
+static int completeRequest(struct otp_conn* conn) {
+    struct otp_request* request;
+    char* start;
+    char* seperator;
+    long avail;
+    long header;
+    long len;
+    long size;
+    uint32_t end;
 
-    memset(buffer, '\0', sizeof(buffer));
-    i = 0;
-    while ((received = recv(sock_fd, &buffer[i], 1, 0)) > 0 && strcmp(&buffer[i], MESSAGE_SEPERATOR) != 0 && strcmp(&buffer[i], MESSAGE_TERMINATOR) != 0)
-        i += received;
-    buffer[i] = '\0';
-    
-    if (received == -1) {
-        perror("recv()");
-        return 0;
-    }
+    request = conn->head;
+    start = &conn->in[conn->in_start];
+    avail = conn->in_len - conn->in_start;
+    if (!request)
+        return avail > 0 ? -1 : 0;
 
-    if (strcmp(buffer, ACK) != 0) {
-        fprintf(stderr, "authenticated(): Failed to be authenticated by server\n");
+    seperator = (char*)memchr(start, MESSAGE_SEPERATOR[0], avail < AUTH_BUFFER_SIZE ? avail : AUTH_BUFFER_SIZE);
+    if (!seperator)
+        return avail < AUTH_BUFFER_SIZE ? 0 : -1;
+    header = seperator - start + 1;
+    if (strtol(start, NULL, 10) != 1)
+        return -1;
+    if (avail < header + (long)sizeof(end))
+        return 0;
+    memcpy(&end, &start[header], sizeof(end));
+    len = ntohl(end);
+    if (len != request->len)
+        return -1;
+    size = (conn->options & OPTION_PACKED) ? packedSize(len) : len;
+    if (avail < header + (long)sizeof(end) + size)
         return 0;
+
+    if (len + 1 > conn->result_size) {
+        conn->result_size = len + 1;
+        conn->result = (char*)realloc(conn->result, conn->result_size);
     }
+    if (conn->options & OPTION_PACKED)
+        unpackText((unsigned char*)&start[header + sizeof(end)], conn->result, len);
+    else
+        memcpy(conn->result, &start[header + sizeof(end)], len);
+    conn->result[len] = '\0';
+    conn->in_start += header + sizeof(end) + size;
+
+    conn->head = request->next;
+    if (!conn->head)
+        conn->tail = NULL;
+    conn->pending--;
+    request->callback(request->arg, 0, conn->result, len);
+    free(request);
+    request = NULL;
     return 1;
 }
 
 /**
- * Determines if string is composed exclusively of characters in the allowed
- * character set.
+ * Counts received bytes of buffer towards transfer, adding them to its
+ * checksum if it checksums.
  */
-int allowedChars(char* s) {
-    int* allowed;
-    int i;
-    int num;
-    int ret;
-
-    allowed = createAllowedCharsHash();
-    i = 0;
-    ret = 1;
-    while (s[i] && ret) {
-        num = s[i++];
-        if (!allowed[num]) {
-            fprintf(stderr, "allowedChars(): Invalid character(s)\n");
-            ret = 0;
-        }
-    }
-    free(allowed);
-    allowed = NULL;
-    return ret;
+static void countReceived(struct transfer* transfer, const char* buffer, long received) {
+    transfer->bytes += received;
+    if (transfer->checksum)
+        transfer->crc = crc32c(transfer->crc, buffer, received);
 }
 
+#ifdef __x86_64__
 /**
- * Concatenates two character arrays in the order in which they are passed.
+ * Updates the raw CRC32C crc with len bytes of data using the SSE4.2 crc32
+ * instruction, eight bytes at a time.
  */
-char* concatenate(const char* s1, const char* s2) {
-    int len;
-    char* buffer;
+__attribute__((target("sse4.2")))
+static uint32_t crcHardware(uint32_t crc, const unsigned char* data, long len) {
+    uint64_t c;
+    uint64_t word;
+    long i;
 
-    len = strlen(s1) + strlen(s2);
-    buffer = (char*)calloc(len + 1, sizeof(char));
-    strcpy(buffer, s1);
-    strcat(buffer, s2);
-    return buffer;
+    c = crc;
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, &data[i], 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    for (; i < len; i++)
+        c = _mm_crc32_u8((uint32_t)c, data[i]);
+    return (uint32_t)c;
 }
+#endif
 
 /**
- * Determines if socket connection attempt is succesful.
+ * Updates the raw CRC32C crc with len bytes of data a byte at a time, building
+ * the lookup table on first use.
  */
-int connected(int sock_fd) {
-    return sock_fd >= 0;
+static uint32_t crcSoftware(uint32_t crc, const unsigned char* data, long len) {
+    uint32_t c;
+    long i;
+    int j;
+
+    if (!crc_table[1]) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (j = 0; j < 8; j++)
+                c = (c >> 1) ^ (-(c & 1) & CRC32C_POLYNOMIAL);
+            crc_table[i] = c;
+        }
+    }
+    for (i = 0; i < len; i++)
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
 }
 
 /**
- * Attempts to accept client socket connection.
+ * Closes the socket of conn and fails every request still pending on it.
  */
-int connectClient(int sock_fd, struct sockaddr* address, socklen_t* client_size) {
-    int client_sock_fd;
+static void failConnection(struct otp_conn* conn) {
+    struct otp_request* request;
 
-    client_sock_fd = accept(sock_fd, address, client_size);
-    if (!connected(client_sock_fd))
-        perror("accept()");
-    return client_sock_fd;
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+    conn->state = CONN_FAILED;
+    while ((request = conn->head)) {
+        conn->head = request->next;
+        conn->pending--;
+        request->callback(request->arg, -1, NULL, 0);
+        free(request);
+        request = NULL;
+    }
+    conn->tail = NULL;
 }
 
 /**
- * Attempts to start up server by binding and listening at socket determined
- * by the socket file descriptor.
+ * Sends as much of the output buffer of conn as the socket takes without
+ * blocking.
+ * 
+ * Returns 1 unless the connection failed.
  */
-int connectSocket(int sock_fd, struct sockaddr* address) {
-    if (bind(sock_fd, address, sizeof(*address)) < 0) {
-        perror("bind()");
-        return 0;
-    } else if (listen(sock_fd, MAX_QUEUE_SIZE) < 0) {
-        perror("listen()");
-        return 0;
+static int flushOutput(struct otp_conn* conn) {
+    ssize_t sent;
+
+    while (conn->out_sent < conn->out_len) {
+        sent = send(conn->fd, &conn->out[conn->out_sent], conn->out_len - conn->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        conn->out_sent += sent;
     }
+    conn->out_sent = 0;
+    conn->out_len = 0;
     return 1;
 }
 
 /**
- * Creates a hash table representing the allowed characters where each bucket
- * is represented by the ASCII numeric representation.
- * 
- * 1 represents the character being part of the allowed character set and
- * 0 represents the character being omitted.
+ * Gathers the low five bits of each byte lane of v into a 40-bit value, the
+ * first lane ending up in the lowest bits.
  */
-int* createAllowedCharsHash(void) {
-    int* hash;
-    int i;
-    int num;
-
-    hash = (int*)calloc(NUM_ASCII_CHARS, sizeof(int));
-    i = 0;
-    while (i < sizeof(ALLOWED_CHARS)) {
-        num = ALLOWED_CHARS[i++];
-        hash[num] = 1;
-    }
-    return hash;
+static uint64_t gatherLanes(uint64_t v) {
+    v = (v & 0x001F001F001F001FULL) | ((v & 0x1F001F001F001F00ULL) >> 3);
+    v = (v & 0x000003FF000003FFULL) | ((v & 0x03FF000003FF0000ULL) >> 6);
+    return (v & 0xFFFFFULL) | ((v >> 12) & 0xFFFFF00000ULL);
 }
 
 /**
- * Creates a character array representing the absolute path to target in
- * directory dir.
+ * Loads a group of eight packed symbols as a 40-bit value.
+ * 
+ * The group is loaded in two parts so that no five byte copy has to go
+ * through memory.
  */
-char* createPath(char* dir, char* target) {
-    char *buffer;
-    char seperator[] = "/";
-    int len;
+static uint64_t loadGroup(const unsigned char* packed) {
+    uint32_t low;
 
-    len = strlen(dir) + strlen(seperator) + strlen(target);
-    buffer = (char*)calloc(len + 1, sizeof(char));
-    strcpy(buffer, dir);
-    strcat(buffer, seperator);
-    strcat(buffer, target);
-    return buffer;
+    memcpy(&low, packed, 4);
+    return low | ((uint64_t)packed[4] << 32);
 }
 
 /**
- * Stores bytes from file pointed to by fd into dynamically sized buffer with
- * the number of bytes read determining its size.
+ * Maps a prefaulted buffer of at least size bytes backed by huge pages.
  * 
- * The last character (excluding the null terminator) is assumed to be a
- * newline and is replaced with a null terminator.
+ * Explicit huge pages are used if any have been reserved; otherwise the
+ * mapping is aligned to HUGE_PAGE_SIZE and marked for transparent huge pages.
  */
-char* getFileData(int fd) {
-    int i;
-    int bytes;
-    int size;
-    char* buffer;
+static struct bufferHeader* mapBuffer(long size) {
+    char* base;
+    char* aligned;
+    long length;
+    struct bufferHeader* header;
 
-    size = DATA_BUFFER_SIZE;
-    buffer = (char*)calloc(size, sizeof(char));
-    i = 0;
-    while ((bytes = read(fd, &buffer[i], 1)) > 0 && strcmp(&buffer[i], FILE_TERMINATOR) != 0) {
-        i += bytes;
-        if (reachedThreshold(i, size))
-            buffer = resize(buffer, size *= 2);
+    length = (size + sizeof(struct bufferHeader) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    base = (char*)mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (base == MAP_FAILED) {
+        base = (char*)mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            perror("mmap()");
+            return NULL;
+        }
+        aligned = (char*)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (aligned > base)
+            munmap(base, aligned - base);
+        munmap(aligned + length, base + HUGE_PAGE_SIZE - aligned);
+        base = aligned;
+        madvise(base, length, MADV_HUGEPAGE);
+        prefaultPages(base, length);
     }
-    buffer[i] = '\0';
-    return buffer;
+
+    header = (struct bufferHeader*)base;
+    header->size = length - sizeof(struct bufferHeader);
+    header->length = length;
+    return header;
 }
 
 /**
- * Gets file descriptor for target in the directory dir.
+ * Signal handler for exiting workers, which writes to the notice pipe so that
+ * the server's wait for a connection or in reapWorkers() ends even if the
+ * worker exited just before it started.
  */
-int getFileDesc(char* dir, char* target) {
-    char* abs;
-    int fd;
+static void noticeWorker(int signum) {
+    char notice;
+    int err;
 
-    abs = createPath(dir, target);
-    fd = open(abs, O_RDONLY);
-    
-    free(abs);
-    abs = NULL;
-    return fd;
+    // A full pipe already holds a notice, so a failed write loses nothing
+    err = errno;
+    notice = '\0';
+    write(notice_fd, &notice, 1);
+    errno = err;
 }
 
 /**
- * Gets key section of response message and stores in buffer.
+ * Touches every page of the length bytes at start so that they are faulted
+ * in up front rather than one at a time by the cipher pass.
  */
-char* getKey(const char* response, char* buffer) {
-    int i;
-    int start;
+static void prefaultPages(char* start, long length) {
+    long i;
+    long page;
 
-    start = strcspn(response, MESSAGE_SEPERATOR) + 1;
-    i = 0;
-    while (response[start])
-        buffer[i++] = response[start++];
-    buffer[i] = '\0';
-    return buffer;
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, length, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+    page = sysconf(_SC_PAGESIZE);
+    for (i = 0; i < length; i += page)
+        start[i] = '\0';
 }
 
 /**
- * Gets length of key section of response message.
+ * Receives everything the socket of conn holds into its input buffer without
+ * blocking, discarding input that was already parsed.
+ * 
+ * Returns 1 unless the connection failed or was closed by the server.
  */
-int getKeyLength(const char* response) {
-    int len;
-    int start;
+static int readInput(struct otp_conn* conn) {
+    ssize_t received;
 
-    start = strcspn(response, MESSAGE_SEPERATOR) + 1;
-    len = 0;
-    while (response[start++])
-        len++;
-    return len;
+    while (1) {
+        if (conn->in_size - conn->in_len < RECV_BUFFER_SIZE) {
+            memmove(conn->in, &conn->in[conn->in_start], conn->in_len - conn->in_start);
+            conn->in_len -= conn->in_start;
+            conn->in_start = 0;
+        }
+        if (conn->in_size - conn->in_len < RECV_BUFFER_SIZE) {
+            conn->in_size = conn->in_len + RECV_BUFFER_SIZE;
+            conn->in = (char*)realloc(conn->in, conn->in_size);
+        }
+        received = recv(conn->fd, &conn->in[conn->in_len], conn->in_size - conn->in_len, MSG_DONTWAIT);
+        if (received > 0) {
+            conn->in_len += received;
+            continue;
+        }
+        if (received == 0)
+            return 0;
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
 }
 
 /**
- * Attempts to store response message in buffer using the connection determined
- * by the socket file descriptor.
+ * Takes in the lane changes reported by workers, counting requests that
+ * turned out to be bulk in stats. Workers back in the small lane are
+ * forgotten.
  */
-char* getResponse(int sock_fd) {
+static void readLaneChanges(struct lanes* lanes, struct serverStats* stats) {
     int i;
-    int bytes;
-    int size;
-    char* buffer;
+    struct laneChange change;
 
-    size = DATA_BUFFER_SIZE;
-    buffer = (char*)calloc(size, sizeof(char));
-    i = 0;
-    while ((bytes = recv(sock_fd, &buffer[i], 1, 0)) > 0
-            && strcmp(&buffer[i], MESSAGE_TERMINATOR) != 0) {
-                i += bytes;
-                if (reachedThreshold(i, size))
-                    buffer = resize(buffer, size *= 2);
+    while (read(lanes->change_fd[0], &change, sizeof(change)) == sizeof(change)) {
+        for (i = 0; i < lanes->num_moved && lanes->moved[i].pid != change.pid; i++)
+            ;
+        if (change.lane == LANE_SMALL) {
+            if (i < lanes->num_moved)
+                lanes->moved[i] = lanes->moved[--lanes->num_moved];
+            continue;
+        }
+        if (i == sizeof(lanes->moved) / sizeof(*lanes->moved))
+            continue;
+        if (change.lane == LANE_QUEUED)
+            stats->bulk++;
+        if (i == lanes->num_moved)
+            lanes->num_moved++;
+        lanes->moved[i] = change;
     }
-    buffer[i] = '\0';
+}
 
-    if (bytes == -1)
-        perror("recv()");
-    return buffer;
+/**
+ * Subtracts 27 from every byte lane of v holding 27 or more. Lanes must not
+ * exceed 154 so that no carry crosses into the next lane.
+ */
+static uint64_t reduceLanes(uint64_t v) {
+    return v - (((v + LANE_HIGH_BITS - LANE_MODULUS) & LANE_HIGH_BITS) >> 7) * sizeof(ALLOWED_CHARS);
 }
 
 /**
- * Gets text section of response message and stores in buffer.
+ * Forgets about a reaped worker, handing back its bulk slot if it held one.
  */
-char* getText(const char* response, char* buffer) {
+static void releaseLane(struct lanes* lanes, pid_t pid) {
+    char token;
     int i;
 
-    i = strcspn(response, MESSAGE_SEPERATOR);
-    strncpy(buffer, response, i);
-    buffer[i + 1] = '\0';
-    return buffer;
+    for (i = 0; i < lanes->num_moved && lanes->moved[i].pid != pid; i++)
+        ;
+    if (i == lanes->num_moved)
+        return;
+
+    token = '\0';
+    if (lanes->moved[i].lane == LANE_BULK && write(lanes->token_fd[1], &token, 1) != 1)
+        perror("write()");
+    lanes->moved[i] = lanes->moved[--lanes->num_moved];
 }
 
 /**
- * Gets length of text section of response message.
+ * Tells the server which lane the calling worker has moved into.
  */
-int getTextLength(const char* response) {
-    return strcspn(response, MESSAGE_SEPERATOR);
+static void reportLane(struct lanes* lanes, int lane) {
+    struct laneChange change;
+
+    change.pid = getpid();
+    change.lane = lane;
+    if (write(lanes->change_fd[1], &change, sizeof(change)) != sizeof(change))
+        perror("write()");
 }
 
 /**
- * Initializes a sockaddr_in structure to be used in the socket connection.
+ * Signal handler flagging that the server should hand its listening socket
+ * over to a new process.
  */
-void initAddressStruct(struct sockaddr_in* address, char* host, int port) {
-    memset((char*)address, '\0', sizeof(*address));
-    address->sin_family = AF_INET;
-    address->sin_port = htons(port);
-    inet_aton(host, &address->sin_addr);
+static void requestReload(int signum) {
+    reload_requested = 1;
 }
 
 /**
- * Determines validity of file descriptor.
+ * Signal handler flagging that server statistics should be reported.
  */
-int locatedFile(int fd) {
-    if (fd < 0) {
-        fprintf(stderr, "locatedFile(): File not found\n");
-        return 0;
+static void requestStats(int signum) {
+    stats_requested = 1;
+}
+
+/**
+ * Reserves len bytes at the end of the output buffer of conn, growing it as
+ * needed, and returns where they begin.
+ */
+static char* reserveOutput(struct otp_conn* conn, long len) {
+    char* buffer;
+
+    if (conn->out_len + len > conn->out_size && conn->out_sent > 0) {
+        memmove(conn->out, &conn->out[conn->out_sent], conn->out_len - conn->out_sent);
+        conn->out_len -= conn->out_sent;
+        conn->out_sent = 0;
     }
-    return 1;
+    if (conn->out_len + len > conn->out_size) {
+        while (conn->out_len + len > conn->out_size)
+            conn->out_size = conn->out_size ? conn->out_size * 2 : RECV_BUFFER_SIZE;
+        conn->out = (char*)realloc(conn->out, conn->out_size);
+    }
+    buffer = &conn->out[conn->out_len];
+    conn->out_len += len;
+    return buffer;
 }
 
 /**
- * Attempts to make a connection based on the socket file descriptor.
+ * Spreads the eight 5-bit symbols of a 40-bit value into the low bits of
+ * consecutive byte lanes, reversing gatherLanes().
  */
-int makeSocketConnection(int sock_fd, struct sockaddr* address, int address_size) {
-    if (connect(sock_fd, address, address_size) < 0) {
-        perror("connect()");
-        return 0;
+static uint64_t spreadLanes(uint64_t x) {
+    x = (x & 0xFFFFFULL) | ((x & 0xFFFFF00000ULL) << 12);
+    x = (x & 0x000003FF000003FFULL) | ((x & 0x000FFC00000FFC00ULL) << 6);
+    return (x & 0x001F001F001F001FULL) | ((x & 0x03E003E003E003E0ULL) << 3);
+}
+
+/**
+ * Stores the 40-bit value of a group of eight packed symbols.
+ */
+static void storeGroup(unsigned char* packed, uint64_t group) {
+    uint32_t low;
+
+    low = (uint32_t)group;
+    memcpy(packed, &low, 4);
+    packed[4] = (unsigned char)(group >> 32);
+}
+
+/**
+ * Queues a single-record batch frame of len characters of text and key on
+ * conn, to be encrypted or decrypted according to mode, and registers the
+ * callback to be given its result.
+ * 
+ * Returns 0 if the request was queued or -1 otherwise.
+ */
+static int submitRequest(struct otp_conn* conn, int mode, const char* text, const char* key, long len, otp_callback callback, void* arg) {
+    char header[AUTH_BUFFER_SIZE];
+    struct otp_request* request;
+    uint32_t end;
+    long size;
+
+    if (!conn || conn->state == CONN_FAILED || conn->mode != mode || len < 0 || len > BATCH_BUFFER_SIZE)
+        return -1;
+
+    snprintf(header, sizeof(header), "1%s", MESSAGE_SEPERATOR);
+    memcpy(reserveOutput(conn, strlen(header)), header, strlen(header));
+    end = htonl((uint32_t)len);
+    memcpy(reserveOutput(conn, sizeof(end)), &end, sizeof(end));
+    if (conn->options & OPTION_PACKED) {
+        size = packedSize(len);
+        packText(text, (unsigned char*)reserveOutput(conn, size), len);
+        packText(key, (unsigned char*)reserveOutput(conn, size), len);
+    } else {
+        memcpy(reserveOutput(conn, len), text, len);
+        memcpy(reserveOutput(conn, len), key, len);
     }
-    return 1;
+
+    request = (struct otp_request*)malloc(sizeof(struct otp_request));
+    request->callback = callback;
+    request->arg = arg;
+    request->len = len;
+    request->next = NULL;
+    if (conn->tail)
+        conn->tail->next = request;
+    else
+        conn->head = request;
+    conn->tail = request;
+    conn->pending++;
+
+    // Requests made once connected go out right away; a failure to send is
+    // picked up by the next otp_process()
+    if (conn->state != CONN_CONNECTING)
+        flushOutput(conn);
+    return 0;
 }
 
 /**
- * Determines if size is at or beyond target threshold.
+ * Maps the character in each byte lane of v to its symbol, its index in the
+ * allowed character set.
  */
-int reachedThreshold(int size, int target) {
-    return size >= target * BUFFER_THRESHOLD;
+static uint64_t symbolLanes(uint64_t v) {
+    // 'A' to 'Z' have low bits 1 to 26 and the space 0, so adding 26 modulo
+    // 27 lines them up with ALLOWED_CHARS
+    return reduceLanes((v & LANE_MASK) + LANE_BIAS);
 }
 
 /**
- * Creates array of new size after copying old data.
+ * Determines if another worker fits in the small lane given the number of
+ * workers alive.
+ */
+int admitWorker(const struct lanes* lanes, int workers) {
+    int bulk;
+    int idle;
+    int i;
+
+    bulk = 0;
+    idle = 0;
+    for (i = 0; i < lanes->num_moved; i++) {
+        if (lanes->moved[i].lane == LANE_IDLE)
+            idle++;
+        else
+            bulk++;
+    }
+    if (bulk > lanes->bulk_processes)
+        bulk = lanes->bulk_processes;
+    if (idle > MAX_IDLE_PROCESSES)
+        idle = MAX_IDLE_PROCESSES;
+    return workers - bulk - idle < MAX_CONCURRENT_PROCESSES;
+}
+
+/**
+ * Allocates a buffer of at least size bytes to be grown with growBuffer() and
+ * released with releaseBuffer().
  * 
- * Passed array is deallocated.
+ * Buffers of HUGE_BUFFER_THRESHOLD bytes or more are backed by huge pages and
+ * prefaulted; smaller buffers come from malloc(). Returns NULL on failure.
  */
-char* resize(char* old, int size) {
-    char* new;
+char* allocBuffer(long size) {
+    struct bufferHeader* header;
 
-    new = (char*)calloc(size, sizeof(char));
-    strcpy(new, old);
+    if (size < HUGE_BUFFER_THRESHOLD) {
+        header = (struct bufferHeader*)malloc(sizeof(struct bufferHeader) + size);
+        if (!header)
+            return NULL;
+        header->size = size;
+        header->length = 0;
+        return (char*)(header + 1);
+    }
 
-    free(old);
-    old = NULL;
-    return new;
+    header = mapBuffer(size);
+    return header ? (char*)(header + 1) : NULL;
 }
 
 /**
- * Attempts to send message over the connection determined by the socket file
- * descriptor.
+ * Determines if correct authentication message is received from client within
+ * the deadline of transfer.
+ * 
+ * Options requested after the authentication message are stored in options.
  */
-int sendMessage(int sock_fd, const char* message) {
+int authenticate(int sock_fd, char* message, struct transfer* transfer, int* options) {
+    char buffer[AUTH_BUFFER_SIZE];
     int i;
-    int sent;
+    int received;
+    int err;
 
+    memset(buffer, '\0', sizeof(buffer));
     i = 0;
-    while (message[i] && (sent = send(sock_fd, &message[i], 1, 0)) > 0)
-        i += sent;
+    while (i < AUTH_BUFFER_SIZE - 1 && (received = recvData(sock_fd, &buffer[i], 1, transfer)) > 0
+            && strcmp(&buffer[i], MESSAGE_SEPERATOR) != 0)
+        i += received;
+    buffer[i] = '\0';
     
-    if (sent == -1) {
-        perror("send()");
+    if (received == -1) {
+        err = errno;
+        perror("recv()");
+        errno = err;
         return 0;
-    } else if (i < strlen(message)) {
-        fprintf(stderr, "sendMessage(): Incomplete message sent\n");
+    }
+
+    *options = parseOptions(&buffer[strcspn(buffer, OPTION_SEPERATOR)]);
+    buffer[strcspn(buffer, OPTION_SEPERATOR)] = '\0';
+    if (strcmp(buffer, message) != 0) {
+        fprintf(stderr, "authenticate(): Failed to authenticate client\n");
         return 0;
     }
     return 1;
 }
 
 /**
- * Determines if s is at least as long as len.
+ * Determines if authentication confirmation message is received from server.
+ * 
+ * Options accepted by the server are stored in options.
+ */
+int authenticated(int sock_fd, char* auth, int* options) {
+    char buffer[AUTH_BUFFER_SIZE];
+    int i;
+    int received;
+
+    memset(buffer, '\0', sizeof(buffer));
+    i = 0;
+    while (i < AUTH_BUFFER_SIZE - 1 && (received = recv(sock_fd, &buffer[i], 1, 0)) > 0
+            && strcmp(&buffer[i], MESSAGE_SEPERATOR) != 0 && strcmp(&buffer[i], MESSAGE_TERMINATOR) != 0)
+        i += received;
+    buffer[i] = '\0';
+    
+    if (received == -1) {
+        perror("recv()");
+        return 0;
+    }
+
+    *options = parseOptions(&buffer[strcspn(buffer, OPTION_SEPERATOR)]);
+    buffer[strcspn(buffer, OPTION_SEPERATOR)] = '\0';
+    if (strcmp(buffer, ACK) != 0) {
+        fprintf(stderr, "authenticated(): Failed to be authenticated by server\n");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Determines if string is composed exclusively of characters in the allowed
+ * character set.
+ */
+int allowedChars(char* s) {
+    int* allowed;
+    long i;
+    int num;
+    int ret;
+
+    allowed = createAllowedCharsHash();
+    i = 0;
+    ret = 1;
+    while (s[i] && ret) {
+        num = s[i++];
+        if (!allowed[num]) {
+            fprintf(stderr, "allowedChars(): Invalid character(s)\n");
+            ret = 0;
+        }
+    }
+    free(allowed);
+    allowed = NULL;
+    return ret;
+}
+
+/**
+ * Determines if string is composed exclusively of lines of characters in the
+ * allowed character set.
+ */
+int allowedRecords(char* s) {
+    int* allowed;
+    long i;
+    int num;
+    int ret;
+
+    allowed = createAllowedCharsHash();
+    allowed[(int)FILE_TERMINATOR[0]] = 1;
+    i = 0;
+    ret = 1;
+    while (s[i] && ret) {
+        num = (unsigned char)s[i++];
+        if (num >= NUM_ASCII_CHARS || !allowed[num]) {
+            fprintf(stderr, "allowedRecords(): Invalid character(s)\n");
+            ret = 0;
+        }
+    }
+    free(allowed);
+    allowed = NULL;
+    return ret;
+}
+
+/**
+ * Waits for a connection on the listening socket determined by the socket file
+ * descriptor, or for a worker to exit.
+ * 
+ * Returns 1 if a connection is ready to be accepted, or 0 if a worker exited
+ * or a signal arrived first, so that the server can reap it or act on the
+ * signal before accepting.
+ */
+int awaitConnection(int sock_fd, struct lanes* lanes) {
+    struct pollfd fds[2];
+
+    fds[0].fd = sock_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = lanes->notice_fd[0];
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR)
+            perror("poll()");
+        return 0;
+    }
+    return !(fds[1].revents & POLLIN) && (fds[0].revents & POLLIN);
+}
+
+/**
+ * Waits up to KEEPALIVE_TIMEOUT seconds for another request on a keep-alive
+ * connection.
+ * 
+ * A worker in the small lane moves into the idle lane while it waits, so that
+ * idle connections do not hold up new ones, and back once a request arrives.
+ * Returns 1 if a request has started to arrive or 0 if the client went quiet
+ * or closed the connection.
+ */
+int awaitRequest(int sock_fd, struct lanes* lanes) {
+    char c;
+    int idle;
+    ssize_t received;
+    struct transfer transfer;
+
+    idle = lanes->lane == LANE_SMALL;
+    if (idle)
+        reportLane(lanes, LANE_IDLE);
+    beginTransfer(&transfer, KEEPALIVE_TIMEOUT, 0);
+    if (!waitTransfer(sock_fd, POLLIN, &transfer))
+        return 0;
+    do {
+        received = recv(sock_fd, &c, 1, MSG_PEEK);
+    } while (received < 0 && errno == EINTR);
+    if (received == 1 && idle)
+        reportLane(lanes, LANE_SMALL);
+    return received == 1;
+}
+
+/**
+ * Transforms each line of text using the line of key at the same position,
+ * sending the records to the server at port in batch frames of at most
+ * MAX_BATCH_RECORDS records and BATCH_BUFFER_SIZE bytes. Resulting lines are
+ * written in order to out_fd at offset, which is advanced past them.
+ */
+int batchRequest(int port, const char* auth_message, int options, const char* text, const char* key, int out_fd, off_t* offset) {
+    char* texts;
+    char* keys;
+    uint32_t* ends;
+    long count;
+    long filled;
+    long len;
+    long record;
+    int ret;
+
+    texts = (char*)malloc(BATCH_BUFFER_SIZE);
+    keys = (char*)malloc(BATCH_BUFFER_SIZE);
+    ends = (uint32_t*)malloc(MAX_BATCH_RECORDS * sizeof(uint32_t));
+    count = 0;
+    filled = 0;
+    record = 0;
+    ret = 1;
+    while (ret && *text) {
+        len = strcspn(text, FILE_TERMINATOR);
+        if (strcspn(key, FILE_TERMINATOR) < len) {
+            fprintf(stderr, "batchRequest(): Key of record %ld is too short\n", record);
+            ret = 0;
+            break;
+        } else if (len > BATCH_BUFFER_SIZE) {
+            fprintf(stderr, "batchRequest(): Record %ld is too long for a batch\n", record);
+            ret = 0;
+            break;
+        }
+
+        if (count == MAX_BATCH_RECORDS || filled + len > BATCH_BUFFER_SIZE) {
+            ret = requestBatch(port, auth_message, options, texts, keys, ends, count, out_fd, offset);
+            count = 0;
+            filled = 0;
+        }
+        memcpy(&texts[filled], text, len);
+        memcpy(&keys[filled], key, len);
+        filled += len;
+        ends[count++] = htonl(filled);
+        record++;
+
+        text += len + (text[len] != '\0');
+        key += strcspn(key, FILE_TERMINATOR);
+        key += (*key != '\0');
+    }
+    if (ret && count > 0)
+        ret = requestBatch(port, auth_message, options, texts, keys, ends, count, out_fd, offset);
+
+    free(texts);
+    texts = NULL;
+    free(keys);
+    keys = NULL;
+    free(ends);
+    ends = NULL;
+    return ret;
+}
+
+/**
+ * Gets the total size of the records of a batch frame from its table of count
+ * end offsets, or -1 if the table is out of order or exceeds BATCH_BUFFER_SIZE.
+ */
+long batchSize(const uint32_t* ends, long count) {
+    long end;
+    long i;
+    long total;
+
+    total = 0;
+    for (i = 0; i < count; i++) {
+        end = ntohl(ends[i]);
+        if (end < total || end > BATCH_BUFFER_SIZE) {
+            fprintf(stderr, "batchSize(): Invalid batch frame\n");
+            return -1;
+        }
+        total = end;
+    }
+    return total;
+}
+
+/**
+ * Marks the start of a request to be traced.
+ */
+void beginTrace(struct trace* trace) {
+    clock_gettime(CLOCK_MONOTONIC, &trace->start);
+}
+
+/**
+ * Starts the clock on a transfer with a deadline of limit seconds and a
+ * minimum throughput of min_rate bytes per second.
+ */
+void beginTransfer(struct transfer* transfer, int limit, int min_rate) {
+    clock_gettime(CLOCK_MONOTONIC, &transfer->start);
+    transfer->bytes = 0;
+    transfer->limit = limit;
+    transfer->min_rate = min_rate;
+    transfer->checksum = 0;
+    transfer->crc = 0;
+}
+
+/**
+ * Measures the throughput of transform with one worker per usable CPU, first
+ * placed by the scheduler and then pinned by pinWorker(), and reports both.
+ * 
+ * Each worker allocates and fills its AFFINITY_BENCH_SIZE buffers only once
+ * placed, so the pages of pinned workers are first touched on their local node,
+ * then transforms them AFFINITY_BENCH_ROUNDS times.
+ */
+int benchmarkAffinity(otp_transform transform) {
+    char* text;
+    char* key;
+    char* buffer;
+    int i;
+    int pinned;
+    int round;
+    int status;
+    int workers;
+    int succeeded;
+    long elapsed;
+    long j;
+    long faults;
+    cpu_set_t allowed;
+    pid_t pid;
+    struct rusage usage;
+    struct timespec start;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity()");
+        return 0;
+    }
+    workers = CPU_COUNT(&allowed);
+    succeeded = 1;
+
+    for (pinned = 0; pinned <= 1; pinned++) {
+        getrusage(RUSAGE_CHILDREN, &usage);
+        faults = usage.ru_minflt + usage.ru_majflt;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < workers; i++) {
+            pid = fork();
+            if (pid < 0) {
+                perror("fork()");
+                succeeded = 0;
+                break;
+            } else if (pid > 0) {
+                continue;
+            }
+
+            if (pinned && !pinWorker(&allowed, i))
+                _exit(2);
+            text = allocBuffer(AFFINITY_BENCH_SIZE);
+            key = allocBuffer(AFFINITY_BENCH_SIZE);
+            buffer = allocBuffer(AFFINITY_BENCH_SIZE);
+            for (j = 0; j < AFFINITY_BENCH_SIZE; j++) {
+                text[j] = ALLOWED_CHARS[j % sizeof(ALLOWED_CHARS)];
+                key[j] = ALLOWED_CHARS[(j / sizeof(ALLOWED_CHARS)) % sizeof(ALLOWED_CHARS)];
+            }
+            for (round = 0; round < AFFINITY_BENCH_ROUNDS; round++)
+                transform(text, key, buffer, AFFINITY_BENCH_SIZE, 0);
+
+            releaseBuffer(text);
+            text = NULL;
+            releaseBuffer(key);
+            key = NULL;
+            releaseBuffer(buffer);
+            buffer = NULL;
+            _exit(0);
+        }
+
+        while (wait(&status) > 0) {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                succeeded = 0;
+        }
+        elapsed = elapsedMs(&start);
+        getrusage(RUSAGE_CHILDREN, &usage);
+        printf("%s: %d workers, %.1f MB/s, %ld page faults\n", pinned ? "pinned" : "unpinned", workers,
+            (double)workers * AFFINITY_BENCH_SIZE * AFFINITY_BENCH_ROUNDS / 1000.0 / (elapsed > 0 ? elapsed : 1),
+            usage.ru_minflt + usage.ru_majflt - faults);
+    }
+    return succeeded;
+}
+
+/**
+ * Concatenates two character arrays in the order in which they are passed.
+ */
+char* concatenate(const char* s1, const char* s2) {
+    int len;
+    char* buffer;
+
+    len = strlen(s1) + strlen(s2);
+    buffer = (char*)calloc(len + 1, sizeof(char));
+    strcpy(buffer, s1);
+    strcat(buffer, s2);
+    return buffer;
+}
+
+/**
+ * Determines if socket connection attempt is succesful.
+ */
+int connected(int sock_fd) {
+    return sock_fd >= 0;
+}
+
+/**
+ * Attempts to accept client socket connection.
+ */
+int connectClient(int sock_fd, struct sockaddr* address, socklen_t* client_size) {
+    int client_sock_fd;
+
+    client_sock_fd = accept(sock_fd, address, client_size);
+    if (!connected(client_sock_fd) && errno != EINTR)
+        perror("accept()");
+    return client_sock_fd;
+}
+
+/**
+ * Attempts to start up server by binding and listening at socket determined
+ * by the socket file descriptor.
+ */
+int connectSocket(int sock_fd, struct sockaddr* address) {
+    if (bind(sock_fd, address, sizeof(*address)) < 0) {
+        perror("bind()");
+        return 0;
+    } else if (listen(sock_fd, MAX_QUEUE_SIZE) < 0) {
+        perror("listen()");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Continues the CRC32C checksum crc, 0 for none yet, over len bytes of data.
+ * 
+ * The SSE4.2 crc32 instruction is used when the processor supports it, as
+ * determined on first use.
+ */
+uint32_t crc32c(uint32_t crc, const char* data, long len) {
+    if (!crc_update) {
+#ifdef __x86_64__
+        crc_update = __builtin_cpu_supports("sse4.2") ? crcHardware : crcSoftware;
+#else
+        crc_update = crcSoftware;
+#endif
+    }
+    return ~crc_update(~crc, (const unsigned char*)data, len);
+}
+
+/**
+ * Creates a hash table representing the allowed characters where each bucket
+ * is represented by the ASCII numeric representation.
+ * 
+ * 1 represents the character being part of the allowed character set and
+ * 0 represents the character being omitted.
+ */
+int* createAllowedCharsHash(void) {
+    int* hash;
+    int i;
+    int num;
+
+    hash = (int*)calloc(NUM_ASCII_CHARS, sizeof(int));
+    i = 0;
+    while (i < sizeof(ALLOWED_CHARS)) {
+        num = ALLOWED_CHARS[i++];
+        hash[num] = 1;
+    }
+    return hash;
+}
+
+/**
+ * Creates or truncates target in the directory dir and gets its file
+ * descriptor for writing.
+ */
+int createFileDesc(char* dir, char* target) {
+    char* abs;
+    int fd;
+
+    abs = createPath(dir, target);
+    fd = open(abs, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    free(abs);
+    abs = NULL;
+    return fd;
+}
+
+/**
+ * Creates the handshake message made up of message followed by the names of
+ * the handshake options set in options.
+ */
+char* createHandshake(const char* message, int options) {
+    char* buffer;
+    int i;
+    int len;
+
+    len = strlen(message) + strlen(MESSAGE_SEPERATOR);
+    for (i = 0; i < sizeof(HANDSHAKE_OPTIONS) / sizeof(*HANDSHAKE_OPTIONS); i++)
+        len += strlen(OPTION_SEPERATOR) + strlen(HANDSHAKE_OPTIONS[i]);
+    buffer = (char*)calloc(len + 1, sizeof(char));
+
+    strcpy(buffer, message);
+    for (i = 0; i < sizeof(HANDSHAKE_OPTIONS) / sizeof(*HANDSHAKE_OPTIONS); i++) {
+        if (options & (1 << i)) {
+            strcat(buffer, OPTION_SEPERATOR);
+            strcat(buffer, HANDSHAKE_OPTIONS[i]);
+        }
+    }
+    strcat(buffer, MESSAGE_SEPERATOR);
+    return buffer;
+}
+
+/**
+ * Creates a character array representing the absolute path to target in
+ * directory dir.
+ */
+char* createPath(char* dir, char* target) {
+    char *buffer;
+    char seperator[] = "/";
+    int len;
+
+    len = strlen(dir) + strlen(seperator) + strlen(target);
+    buffer = (char*)calloc(len + 1, sizeof(char));
+    strcpy(buffer, dir);
+    strcat(buffer, seperator);
+    strcat(buffer, target);
+    return buffer;
+}
+
+/**
+ * Gets the number of milliseconds elapsed since start.
+ */
+long elapsedMs(const struct timespec* start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000L
+        + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+/**
+ * Moves the calling worker into the bulk lane, waiting up to BULK_WAIT_TIMEOUT
+ * seconds for a bulk slot and then lowering its priority by BULK_NICENESS so
+ * that workers in the small lane are scheduled first.
+ * 
+ * The clock of transfer, the request still being received if given, restarts
+ * once the slot is held so that the wait does not count against the client's
+ * throughput. Returns 1 once the worker holds a bulk slot or 0 otherwise, with
+ * errno set to ETIMEDOUT if none freed up in time.
+ */
+int enterBulkLane(struct lanes* lanes, struct transfer* transfer) {
+    char token;
+    long remaining;
+    ssize_t received;
+    struct pollfd pfd;
+    struct transfer wait;
+
+    if (lanes->lane == LANE_BULK)
+        return 1;
+    reportLane(lanes, LANE_QUEUED);
+
+    beginTransfer(&wait, BULK_WAIT_TIMEOUT, 0);
+    pfd.fd = lanes->token_fd[0];
+    pfd.events = POLLIN;
+    while ((received = read(lanes->token_fd[0], &token, 1)) != 1) {
+        if (received == 0 || (errno != EAGAIN && errno != EINTR)) {
+            perror("read()");
+            return 0;
+        }
+        remaining = wait.limit * 1000L - elapsedMs(&wait.start);
+        if (remaining <= 0) {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        poll(&pfd, 1, remaining);
+    }
+
+    reportLane(lanes, LANE_BULK);
+    lanes->lane = LANE_BULK;
+    if (transfer) {
+        clock_gettime(CLOCK_MONOTONIC, &transfer->start);
+        transfer->bytes = 0;
+    }
+
+    errno = 0;
+    if (nice(BULK_NICENESS) == -1 && errno != 0)
+        perror("nice()");
+    return 1;
+}
+
+/**
+ * Gets the exit status a worker should report after a failed operation.
+ */
+int failureStatus(void) {
+    return (errno == ETIMEDOUT) ? EXIT_TIMEOUT : 2;
+}
+
+/**
+ * Stores every byte of the file pointed to by fd into a dynamically sized,
+ * null terminated buffer from allocBuffer().
+ * 
+ * Regular files are read into a buffer of their size; others grow it each
+ * time a read fills it. Returns NULL if the buffer cannot be allocated.
+ */
+char* getFileContents(int fd) {
+    long i;
+    long size;
+    int regular;
+    ssize_t bytes;
+    char* buffer;
+    char* grown;
+    struct stat info;
+
+    regular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+    size = regular ? info.st_size + 1 : DATA_BUFFER_SIZE;
+    buffer = allocBuffer(size);
+    i = 0;
+    while (buffer && (bytes = read(fd, &buffer[i], size - i - 1)) > 0) {
+        i += bytes;
+        if (!regular && i == size - 1) {
+            grown = growBuffer(buffer, size *= 2);
+            if (!grown)
+                releaseBuffer(buffer);
+            buffer = grown;
+        }
+    }
+    if (!buffer) {
+        fprintf(stderr, "getFileContents(): File too large to be read\n");
+        return NULL;
+    }
+    buffer[i] = '\0';
+    return buffer;
+}
+
+/**
+ * Stores bytes from file pointed to by fd into dynamically sized buffer from
+ * allocBuffer() with the number of bytes read determining its size.
+ * 
+ * Bytes are read up to the first newline, which is replaced with a null
+ * terminator. Regular files are read into a buffer of their size in large
+ * reads; others grow it each time a read fills it. Returns NULL if the buffer
+ * cannot be allocated.
+ */
+char* getFileData(int fd) {
+    long i;
+    long size;
+    int regular;
+    ssize_t bytes;
+    long end;
+    char* buffer;
+    char* grown;
+    char* terminator;
+    struct stat info;
+
+    regular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+    size = regular ? info.st_size + 1 : DATA_BUFFER_SIZE;
+    buffer = allocBuffer(size);
+    i = 0;
+    end = -1;
+    while (buffer && end < 0 && (bytes = read(fd, &buffer[i], size - i - 1)) > 0) {
+        terminator = memchr(&buffer[i], FILE_TERMINATOR[0], bytes);
+        if (terminator)
+            end = terminator - buffer;
+        i += bytes;
+        if (!regular && i == size - 1) {
+            grown = growBuffer(buffer, size *= 2);
+            if (!grown)
+                releaseBuffer(buffer);
+            buffer = grown;
+        }
+    }
+    if (!buffer) {
+        fprintf(stderr, "getFileData(): File too large to be read\n");
+        return NULL;
+    }
+    buffer[end >= 0 ? end : i] = '\0';
+    return buffer;
+}
+
+/**
+ * Gets file descriptor for target in the directory dir.
+ */
+int getFileDesc(char* dir, char* target) {
+    char* abs;
+    int fd;
+
+    abs = createPath(dir, target);
+    fd = open(abs, O_RDONLY);
+    
+    free(abs);
+    abs = NULL;
+    return fd;
+}
+
+/**
+ * Gets the count heading a packed or batch frame using the connection
+ * determined by the socket file descriptor, or -1 if none could be received.
+ * 
+ * Whatever has arrived is peeked at and only the bytes up to the separator
+ * are taken, so a header arriving whole costs a single wait and read.
+ */
+long getFrameLength(int sock_fd, struct transfer* transfer) {
+    char buffer[AUTH_BUFFER_SIZE];
+    char* separator;
+    char* end;
+    int i;
+    int received;
+    long len;
+
+    memset(buffer, '\0', sizeof(buffer));
+    separator = NULL;
+    i = 0;
+    while (!separator && i < AUTH_BUFFER_SIZE - 1) {
+        if (transfer && !waitTransfer(sock_fd, POLLIN, transfer))
+            return -1;
+        while ((received = recv(sock_fd, &buffer[i], AUTH_BUFFER_SIZE - 1 - i, MSG_PEEK)) < 0 && errno == EINTR)
+            ;
+        if (received <= 0)
+            return -1;
+        separator = (char*)memchr(&buffer[i], MESSAGE_SEPERATOR[0], received);
+        if (separator)
+            received = separator + 1 - &buffer[i];
+        if (recv(sock_fd, &buffer[i], received, 0) != received)
+            return -1;
+        if (transfer)
+            countReceived(transfer, &buffer[i], received);
+        i += received;
+    }
+    if (!separator)
+        return -1;
+    i = separator - buffer;
+    buffer[i] = '\0';
+
+    len = strtol(buffer, &end, 10);
+    if (i == 0 || *end || len < 0) {
+        fprintf(stderr, "getFrameLength(): Invalid frame header\n");
+        return -1;
+    }
+    return len;
+}
+
+/**
+ * Gets key section of response message and stores in buffer.
+ */
+char* getKey(const char* response, char* buffer) {
+    long i;
+    long start;
+
+    start = strcspn(response, MESSAGE_SEPERATOR) + 1;
+    i = 0;
+    while (response[start])
+        buffer[i++] = response[start++];
+    buffer[i] = '\0';
+    return buffer;
+}
+
+/**
+ * Gets length of key section of response message.
+ */
+long getKeyLength(const char* response) {
+    long len;
+    long start;
+
+    start = strcspn(response, MESSAGE_SEPERATOR) + 1;
+    len = 0;
+    while (response[start++])
+        len++;
+    return len;
+}
+
+/**
+ * Gets the usable CPUs of each NUMA node with any, as listed under
+ * NODE_SYSFS_PATH, storing up to max_nodes sets in nodes.
+ * 
+ * Hosts without NUMA topology are treated as a single node. Returns the
+ * number of nodes stored.
+ */
+int getNodeCpus(cpu_set_t* nodes, int max_nodes) {
+    char path[PATH_BUFFER_SIZE];
+    char list[CPU_LIST_BUFFER_SIZE];
+    int count;
+    int node;
+    cpu_set_t allowed;
+    FILE* file;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity()");
+        CPU_ZERO(&allowed);
+    }
+
+    // Node numbers need not be contiguous
+    count = 0;
+    for (node = 0; node < MAX_NUMA_NODES && count < max_nodes; node++) {
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", NODE_SYSFS_PATH, node);
+        file = fopen(path, "r");
+        if (!file)
+            continue;
+        if (fgets(list, sizeof(list), file) && parseCpuList(list, &nodes[count]) > 0) {
+            CPU_AND(&nodes[count], &nodes[count], &allowed);
+            if (CPU_COUNT(&nodes[count]) > 0)
+                count++;
+        }
+        fclose(file);
+    }
+
+    if (count == 0 && max_nodes > 0) {
+        nodes[0] = allowed;
+        count = 1;
+    }
+    return count;
+}
+
+/**
+ * Attempts to store response message in buffer from allocBuffer() using the
+ * connection determined by the socket file descriptor.
+ * 
+ * Bytes are received in chunks until the message terminator arrives or the
+ * peer closes the connection, along with the checksum trailer if transfer
+ * checksums. Given lanes, the worker moves into the bulk lane as soon as
+ * BULK_THRESHOLD bytes have arrived. NULL is returned if receiving fails or
+ * the deadlines of transfer are missed.
+ */
+char* getResponse(int sock_fd, struct transfer* transfer, struct lanes* lanes) {
+    long i;
+    long size;
+    long end;
+    int bytes;
+    int err;
+    char* buffer;
+    char* grown;
+    char* terminator;
+
+    size = DATA_BUFFER_SIZE;
+    buffer = allocBuffer(size);
+    if (!buffer)
+        return NULL;
+    i = 0;
+    end = -1;
+    while (end < 0 && (bytes = recvData(sock_fd, &buffer[i], (size - i - 1 < INT_MAX) ? size - i - 1 : INT_MAX, transfer)) > 0) {
+        terminator = memchr(&buffer[i], MESSAGE_TERMINATOR[0], bytes);
+        if (terminator)
+            end = terminator - buffer;
+        i += bytes;
+        if (lanes && i >= BULK_THRESHOLD && !enterBulkLane(lanes, transfer)) {
+            releaseBuffer(buffer);
+            buffer = NULL;
+            return NULL;
+        }
+        if (reachedThreshold(i, size)) {
+            grown = growBuffer(buffer, size *= 2);
+            if (!grown) {
+                fprintf(stderr, "getResponse(): Message too large to be received\n");
+                releaseBuffer(buffer);
+                buffer = NULL;
+                return NULL;
+            }
+            buffer = grown;
+        }
+    }
+    // A checksummed message is followed by its trailer, which may not have
+    // arrived along with the terminator
+    while (end >= 0 && transfer && transfer->checksum && i < end + 1 + CHECKSUM_SIZE
+        && (bytes = recvData(sock_fd, &buffer[i], end + 1 + CHECKSUM_SIZE - i, transfer)) > 0)
+            i += bytes;
+
+    if (bytes == -1) {
+        err = errno;
+        perror("recv()");
+        releaseBuffer(buffer);
+        buffer = NULL;
+        errno = err;
+        return NULL;
+    }
+    buffer[end < 0 ? i : end] = '\0';
+    return buffer;
+}
+
+/**
+ * Gets text section of response message and stores in buffer.
+ */
+char* getText(const char* response, char* buffer) {
+    long i;
+
+    i = strcspn(response, MESSAGE_SEPERATOR);
+    strncpy(buffer, response, i);
+    buffer[i] = '\0';
+    return buffer;
+}
+
+/**
+ * Gets length of text section of response message.
+ */
+long getTextLength(const char* response) {
+    return strcspn(response, MESSAGE_SEPERATOR);
+}
+
+/**
+ * Grows a buffer from allocBuffer() to hold at least size bytes, keeping its
+ * contents.
+ * 
+ * Mapped buffers are remapped in place of being copied where possible.
+ * Returns the grown buffer, which may have moved, or NULL on failure.
+ */
+char* growBuffer(char* buffer, long size) {
+    char* base;
+    char* grown;
+    long length;
+    long old_length;
+    struct bufferHeader* header;
+
+    header = (struct bufferHeader*)buffer - 1;
+    if (size <= header->size)
+        return buffer;
+
+    if (header->length == 0 && size < HUGE_BUFFER_THRESHOLD) {
+        header = (struct bufferHeader*)realloc(header, sizeof(struct bufferHeader) + size);
+        if (!header)
+            return NULL;
+        header->size = size;
+        return (char*)(header + 1);
+    }
+
+    if (header->length > 0) {
+        old_length = header->length;
+        length = (size + sizeof(struct bufferHeader) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        base = (char*)mremap(header, header->length, length, MREMAP_MAYMOVE);
+        if (base != MAP_FAILED) {
+            madvise(base, length, MADV_HUGEPAGE);
+            prefaultPages(&base[old_length], length - old_length);
+            header = (struct bufferHeader*)base;
+            header->size = length - sizeof(struct bufferHeader);
+            header->length = length;
+            return (char*)(header + 1);
+        }
+    }
+
+    // Buffers outgrowing malloc(), or mappings that cannot be remapped, such
+    // as explicit huge pages on some kernels, are copied over
+    grown = allocBuffer(size);
+    if (!grown)
+        return NULL;
+    memcpy(grown, buffer, header->size);
+    if (header->length > 0)
+        munmap(header, header->length);
+    else
+        free(header);
+    return grown;
+}
+
+/**
+ * Takes over the listening socket handed down by a reloading server through
+ * the LISTEN_FD_ENV environment variable, storing it in sock_fd.
+ * 
+ * Returns 1 if a listening socket was handed down or 0 otherwise.
+ */
+int inheritListener(int* sock_fd) {
+    char* value;
+    int fd;
+    int listening;
+    socklen_t len;
+
+    value = getenv(LISTEN_FD_ENV);
+    if (!value)
+        return 0;
+    fd = atoi(value);
+    unsetenv(LISTEN_FD_ENV);
+
+    len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening) {
+        fprintf(stderr, "inheritListener(): Handed down descriptor is not a listening socket\n");
+        return 0;
+    }
+    *sock_fd = fd;
+    return 1;
+}
+
+/**
+ * Initializes a sockaddr_in structure to be used in the socket connection.
+ */
+void initAddressStruct(struct sockaddr_in* address, char* host, int port) {
+    memset((char*)address, '\0', sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(port);
+    inet_aton(host, &address->sin_addr);
+}
+
+/**
+ * Sets up the change and token pipes of lanes, filling the latter with a
+ * token for every usable CPU, up to MAX_BULK_WORKERS, and lets exiting workers
+ * wake the server.
+ * 
+ * Twice as many bulk workers may wait for a token outside the small lane, so
+ * that one is ready to take every token handed back.
+ */
+int initLanes(struct lanes* lanes) {
+    char token;
+    int i;
+    cpu_set_t allowed;
+    struct sigaction action;
+
+    memset(lanes, '\0', sizeof(struct lanes));
+    lanes->lane = LANE_SMALL;
+    lanes->bulk_workers = 1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 1)
+        lanes->bulk_workers = CPU_COUNT(&allowed);
+    if (lanes->bulk_workers > MAX_BULK_WORKERS)
+        lanes->bulk_workers = MAX_BULK_WORKERS;
+    lanes->bulk_processes = 2 * lanes->bulk_workers;
+    if (pipe2(lanes->change_fd, O_NONBLOCK | O_CLOEXEC) < 0 || pipe2(lanes->token_fd, O_NONBLOCK | O_CLOEXEC) < 0
+        || pipe2(lanes->notice_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+            perror("pipe2()");
+            return 0;
+    }
+    notice_fd = lanes->notice_fd[1];
+
+    token = '\0';
+    for (i = 0; i < lanes->bulk_workers; i++) {
+        if (write(lanes->token_fd[1], &token, 1) != 1) {
+            perror("write()");
+            return 0;
+        }
+    }
+
+    // An exiting worker ends the server's wait for a connection through the
+    // notice pipe, so the bulk slot it held is handed back right away
+    memset(&action, '\0', sizeof(action));
+    action.sa_handler = noticeWorker;
+    action.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGCHLD, &action, NULL) < 0) {
+        perror("sigaction()");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Installs the SIGHUP handler used to request a reload, which does not restart
+ * interrupted system calls either.
+ */
+int installReloadHandler(void) {
+    struct sigaction action;
+
+    memset(&action, '\0', sizeof(action));
+    action.sa_handler = requestReload;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGHUP, &action, NULL) < 0) {
+        perror("sigaction()");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Installs the SIGUSR1 handler used to request a statistics report.
+ * 
+ * The handler does not restart interrupted system calls so that a server
+ * blocked in accept() or waitpid() gets to report promptly.
+ */
+int installStatsHandler(void) {
+    struct sigaction action;
+
+    memset(&action, '\0', sizeof(action));
+    action.sa_handler = requestStats;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, NULL) < 0) {
+        perror("sigaction()");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Determines validity of file descriptor.
+ */
+int locatedFile(int fd) {
+    if (fd < 0) {
+        fprintf(stderr, "locatedFile(): File not found\n");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Attempts to make a connection based on the socket file descriptor.
+ */
+int makeSocketConnection(int sock_fd, struct sockaddr* address, int address_size) {
+    if (connect(sock_fd, address, address_size) < 0) {
+        perror("connect()");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Opens the trace at path for a server in mode to append its records to.
+ * 
+ * Records are appended by workers with single writes to a file opened with
+ * O_APPEND, so records of concurrent workers never interleave.
+ */
+int openTrace(struct trace* trace, const char* path, int mode) {
+    memset(trace, '\0', sizeof(struct trace));
+    trace->mode = mode;
+    trace->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace->fd < 0) {
+        perror("open()");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Closes conn, failing every request still pending on it, and releases it.
+ */
+void otp_close(struct otp_conn* conn) {
+    if (!conn)
+        return;
+    failConnection(conn);
+    free(conn->out);
+    conn->out = NULL;
+    free(conn->in);
+    conn->in = NULL;
+    free(conn->result);
+    conn->result = NULL;
+    free(conn);
+}
+
+/**
+ * Starts a non-blocking connection to the server at the given port that
+ * encrypts or decrypts according to mode, OTP_ENCRYPT or OTP_DECRYPT.
+ * 
+ * The handshake requesting batch frames, keep-alive and any of the given
+ * options is queued right away and completed by otp_process(). Requests may
+ * be made before it has been acknowledged. A connection that could not be
+ * started is returned in the failed state.
+ */
+struct otp_conn* otp_connect(int port, int mode, int options) {
+    char* auth;
+    struct otp_conn* conn;
+    struct sockaddr_in address;
+
+    conn = (struct otp_conn*)calloc(1, sizeof(struct otp_conn));
+    conn->mode = mode;
+    conn->options = (options & OPTION_PACKED) | OPTION_BATCH | OPTION_KEEPALIVE;
+    conn->state = CONN_CONNECTING;
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    initAddressStruct(&address, LOCALHOST, port);
+    if (conn->fd < 0 || (connect(conn->fd, (struct sockaddr*)&address, sizeof(address)) < 0 && errno != EINPROGRESS)) {
+        perror("connect()");
+        failConnection(conn);
+        return conn;
+    }
+    setNoDelay(conn->fd);
+
+    auth = createHandshake(mode == OTP_DECRYPT ? DEC_AUTH_MESSAGE : ENC_AUTH_MESSAGE, conn->options);
+    memcpy(reserveOutput(conn, strlen(auth)), auth, strlen(auth));
+    free(auth);
+    auth = NULL;
+    return conn;
+}
+
+/**
+ * Requests len characters of ciphertext to be decrypted with key on conn.
+ * 
+ * Both are copied into the connection's output buffer, so they may be
+ * released once this returns; callback is given the resulting plaintext once
+ * it arrives. Returns 0 if the request was made or -1 otherwise.
+ */
+int otp_decrypt_async(struct otp_conn* conn, const char* ciphertext, const char* key, long len, otp_callback callback, void* arg) {
+    return submitRequest(conn, OTP_DECRYPT, ciphertext, key, len, callback, arg);
+}
+
+/**
+ * Requests len characters of plaintext to be encrypted with key on conn.
+ * 
+ * Both are copied into the connection's output buffer, so they may be
+ * released once this returns; callback is given the resulting ciphertext once
+ * it arrives. Returns 0 if the request was made or -1 otherwise.
+ */
+int otp_encrypt_async(struct otp_conn* conn, const char* plaintext, const char* key, long len, otp_callback callback, void* arg) {
+    return submitRequest(conn, OTP_ENCRYPT, plaintext, key, len, callback, arg);
+}
+
+/**
+ * Gets the poll events to wait for on the socket of conn.
+ */
+short otp_events(struct otp_conn* conn) {
+    if (conn->state == CONN_FAILED)
+        return 0;
+    if (conn->state == CONN_CONNECTING)
+        return POLLOUT;
+    return POLLIN | (conn->out_sent < conn->out_len ? POLLOUT : 0);
+}
+
+/**
+ * Gets the socket file descriptor of conn to be polled by the caller's event
+ * loop, or -1 once the connection has failed.
+ */
+int otp_fd(struct otp_conn* conn) {
+    return conn->fd;
+}
+
+/**
+ * Gets the number of requests on conn still awaiting their response.
+ */
+long otp_pending(struct otp_conn* conn) {
+    return conn->pending;
+}
+
+/**
+ * Creates a pool of size connections to the server at the given port, each
+ * started with otp_connect().
+ */
+struct otp_pool* otp_pool_create(int port, int mode, int options, int size) {
+    struct otp_pool* pool;
+    int i;
+
+    pool = (struct otp_pool*)calloc(1, sizeof(struct otp_pool));
+    pool->port = port;
+    pool->mode = mode;
+    pool->options = options;
+    pool->size = size;
+    pool->conns = (struct otp_conn**)calloc(size, sizeof(struct otp_conn*));
+    pool->fds = (struct pollfd*)calloc(size, sizeof(struct pollfd));
+    for (i = 0; i < size; i++)
+        pool->conns[i] = otp_connect(port, mode, options);
+    return pool;
+}
+
+/**
+ * Closes every connection of pool and releases it.
+ */
+void otp_pool_destroy(struct otp_pool* pool) {
+    int i;
+
+    if (!pool)
+        return;
+    for (i = 0; i < pool->size; i++)
+        otp_close(pool->conns[i]);
+    free(pool->conns);
+    pool->conns = NULL;
+    free(pool->fds);
+    pool->fds = NULL;
+    free(pool);
+}
+
+/**
+ * Gets the connection of pool with the fewest pending requests to make the
+ * next request on, reconnecting connections that have failed.
+ * 
+ * Returns NULL if no connection could be started.
+ */
+struct otp_conn* otp_pool_get(struct otp_pool* pool) {
+    struct otp_conn* best;
+    int i;
+
+    best = NULL;
+    for (i = 0; i < pool->size; i++) {
+        if (pool->conns[i]->state == CONN_FAILED) {
+            otp_close(pool->conns[i]);
+            pool->conns[i] = otp_connect(pool->port, pool->mode, pool->options);
+        }
+        if (pool->conns[i]->state != CONN_FAILED && (!best || pool->conns[i]->pending < best->pending))
+            best = pool->conns[i];
+    }
+    return best;
+}
+
+/**
+ * Waits up to timeout milliseconds for any connection of pool to become ready
+ * and processes every one that did, running the callbacks of completed
+ * requests.
+ * 
+ * Returns the number of requests still pending across the pool.
+ */
+long otp_pool_poll(struct otp_pool* pool, int timeout) {
+    long pending;
+    int i;
+
+    for (i = 0; i < pool->size; i++) {
+        pool->fds[i].fd = otp_fd(pool->conns[i]);
+        pool->fds[i].events = otp_events(pool->conns[i]);
+        pool->fds[i].revents = 0;
+    }
+    if (poll(pool->fds, pool->size, timeout) < 0 && errno != EINTR)
+        perror("poll()");
+
+    pending = 0;
+    for (i = 0; i < pool->size; i++) {
+        if (pool->fds[i].revents)
+            otp_process(pool->conns[i], pool->fds[i].revents);
+        pending += otp_pending(pool->conns[i]);
+    }
+    return pending;
+}
+
+/**
+ * Advances conn given the poll events that were returned for its socket.
+ * 
+ * Completes the connection and handshake, sends queued requests without
+ * blocking and hands every response that arrived to its request's callback,
+ * oldest first. Callbacks may make further requests but must not close the
+ * connection they are called from.
+ * 
+ * Returns 1 if the connection is still usable or 0 once it has failed, in
+ * which case every pending request has been failed with status -1.
+ */
+int otp_process(struct otp_conn* conn, short revents) {
+    int error;
+    int open;
+    int status;
+    socklen_t error_len;
+
+    if (conn->state == CONN_FAILED)
+        return 0;
+    if (conn->state == CONN_CONNECTING) {
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+            return 1;
+        error = 0;
+        error_len = sizeof(error);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0) {
+            if (error != 0)
+                errno = error;
+            perror("connect()");
+            failConnection(conn);
+            return 0;
+        }
+        conn->state = CONN_HANDSHAKE;
+    }
+
+    open = flushOutput(conn);
+    if (open && (revents & (POLLIN | POLLERR | POLLHUP)))
+        open = readInput(conn);
+
+    // Whatever arrived before the server closed the connection is still
+    // handed out
+    status = 0;
+    if (conn->state == CONN_HANDSHAKE)
+        status = completeHandshake(conn);
+    while (status >= 0 && conn->state == CONN_READY && (status = completeRequest(conn)) > 0)
+        ;
+    if (open && status >= 0)
+        open = flushOutput(conn);
+
+    if (!open || status < 0) {
+        failConnection(conn);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Gets the number of bytes taken up by len packed symbols.
+ */
+long packedSize(long len) {
+    return (len * 5 + 7) / 8;
+}
+
+/**
+ * Packs len characters of text from the allowed character set into 5-bit
+ * symbols stored in buffer.
+ * 
+ * Each group of eight characters is mapped to symbols and packed into five
+ * bytes at once, one symbol per byte lane of a 64-bit word.
+ */
+void packText(const char* text, unsigned char* buffer, long len) {
+    char tail[8];
+    long i;
+    uint64_t lanes;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&lanes, &text[i], 8);
+        storeGroup(&buffer[i / 8 * 5], gatherLanes(symbolLanes(lanes)));
+    }
+    if (i < len) {
+        memset(tail, ALLOWED_CHARS[0], sizeof(tail));
+        memcpy(tail, &text[i], len - i);
+        memcpy(&lanes, tail, 8);
+        lanes = gatherLanes(symbolLanes(lanes));
+        memcpy(&buffer[i / 8 * 5], &lanes, packedSize(len - i));
+    }
+}
+
+/**
+ * Transforms text using len bytes of key by splitting both into aligned
+ * ranges, each requested with the handshake options over its own connection to
+ * the server at port from a child process, with the results written in place
+ * to out_fd starting at offset.
+ * 
+ * Ranges are multiples of RANGE_ALIGNMENT so every positional write starts on
+ * a page boundary; a single range is requested without forking. Returns 1 if
+ * every range succeeded.
+ */
+int parallelRequest(int port, const char* auth_message, int options, const char* text, const char* key, long len, int connections, int out_fd, off_t offset) {
+    long range;
+    long start;
+    int children;
+    int status;
+    int ret;
+    pid_t pid;
+
+    range = (len + connections - 1) / connections;
+    range = (range + RANGE_ALIGNMENT - 1) / RANGE_ALIGNMENT * RANGE_ALIGNMENT;
+    if (range >= len)
+        return requestRange(port, auth_message, options, text, key, len, out_fd, offset);
+
+    children = 0;
+    ret = 1;
+    for (start = 0; start < len; start += range) {
+        pid = fork();
+        if (pid == -1) {
+            perror("fork()");
+            ret = 0;
+            break;
+        } else if (pid == 0) {
+            _exit(requestRange(port, auth_message, options, &text[start], &key[start],
+                (len - start < range) ? len - start : range, out_fd, offset + start) ? 0 : 2);
+        }
+        children++;
+    }
+
+    while (children > 0 && wait(&status) > 0) {
+        children--;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ret = 0;
+    }
+    return ret;
+}
+
+/**
+ * Parses a list of CPUs and CPU ranges such as "0-3,8,10-11", as found in
+ * sysfs, into set.
+ * 
+ * Returns the number of CPUs in set.
+ */
+int parseCpuList(const char* s, cpu_set_t* set) {
+    char* end;
+    long first;
+    long last;
+
+    CPU_ZERO(set);
+    while (*s) {
+        first = strtol(s, &end, 10);
+        if (end == s)
+            break;
+        last = first;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s)
+                break;
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            if (first >= 0)
+                CPU_SET(first, set);
+        }
+        s = end + strspn(end, ",\n");
+    }
+    return CPU_COUNT(set);
+}
+
+/**
+ * Gets the handshake option flags named in s, each name preceded by the option
+ * seperator. Unknown names are ignored.
+ */
+int parseOptions(const char* s) {
+    int i;
+    int len;
+    int options;
+
+    options = 0;
+    while (*s) {
+        s += strspn(s, OPTION_SEPERATOR);
+        len = strcspn(s, OPTION_SEPERATOR);
+        for (i = 0; i < sizeof(HANDSHAKE_OPTIONS) / sizeof(*HANDSHAKE_OPTIONS); i++) {
+            if (strlen(HANDSHAKE_OPTIONS[i]) == len && strncmp(s, HANDSHAKE_OPTIONS[i], len) == 0)
+                options |= 1 << i;
+        }
+        s += len;
+    }
+    return options;
+}
+
+/**
+ * Pins the calling process to a single CPU of allowed, picked round-robin by
+ * index, so that the memory it goes on to touch is allocated on that CPU's
+ * node.
+ */
+int pinWorker(const cpu_set_t* allowed, long index) {
+    int count;
+    int cpu;
+    long n;
+    cpu_set_t target;
+
+    count = CPU_COUNT(allowed);
+    if (count == 0)
+        return 0;
+
+    n = index % count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, allowed) && n-- == 0)
+            break;
+    }
+    CPU_ZERO(&target);
+    CPU_SET(cpu, &target);
+    if (sched_setaffinity(0, sizeof(target), &target) < 0) {
+        perror("sched_setaffinity()");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Writes server statistics to standard error.
+ */
+void printStats(const struct serverStats* stats) {
+    struct rusage usage;
+
+    memset(&usage, '\0', sizeof(usage));
+    getrusage(RUSAGE_CHILDREN, &usage);
+    fprintf(stderr, "accepted: %ld, completed: %ld, failed: %ld, timeouts: %ld, bulk: %ld, page faults: %ld minor, %ld major\n",
+        stats->accepted, stats->completed, stats->failed, stats->timeouts, stats->bulk,
+        usage.ru_minflt, usage.ru_majflt);
+}
+
+/**
+ * Determines if size is at or beyond target threshold.
+ */
+int reachedThreshold(long size, long target) {
+    return size >= target * BUFFER_THRESHOLD;
+}
+
+/**
+ * Collects exited worker processes and tallies their exit statuses, taking in
+ * the lane changes workers reported and handing back the bulk slots of those
+ * collected.
+ * 
+ * If block is set and no worker has exited, first waits up to
+ * LANE_POLL_INTERVAL milliseconds for one to exit or leave the small lane.
+ * Workers are collected REAP_BATCH_SIZE at a time. Returns the number of
+ * workers collected.
+ */
+int reapWorkers(struct serverStats* stats, struct lanes* lanes, int block) {
+    char notices[REAP_BATCH_SIZE];
+    int count;
+    int i;
+    int reaped;
+    int status;
+    pid_t pid;
+    pid_t pids[REAP_BATCH_SIZE];
+    siginfo_t info;
+    struct pollfd fds[2];
+
+    // Notices are cleared before collecting, so a worker exiting from here on
+    // leaves one behind for the next wait
+    while (read(lanes->notice_fd[0], notices, sizeof(notices)) > 0)
+        ;
+
+    // Waits for a worker to exit or leave the small lane
+    memset(&info, '\0', sizeof(info));
+    if (block && waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0) {
+        fds[0].fd = lanes->change_fd[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = lanes->notice_fd[0];
+        fds[1].events = POLLIN;
+        poll(fds, 2, LANE_POLL_INTERVAL);
+    }
+
+    reaped = 0;
+    do {
+        count = 0;
+        while (count < REAP_BATCH_SIZE && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+                stats->completed++;
+            else if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_TIMEOUT)
+                stats->timeouts++;
+            else
+                stats->failed++;
+            pids[count++] = pid;
+        }
+
+        // A worker's lane changes are all in the pipe by the time it has
+        // exited, so they are taken in after collecting it and none is left
+        // behind for a dead worker
+        readLaneChanges(lanes, stats);
+        for (i = 0; i < count; i++)
+            releaseLane(lanes, pids[i]);
+        reaped += count;
+    } while (count == REAP_BATCH_SIZE);
+    return reaped;
+}
+
+/**
+ * Receives a packed response of len symbols using the connection determined by
+ * the socket file descriptor, writing it unpacked to out_fd at offset.
+ * 
+ * The response is received and written in chunks of RECV_BUFFER_SIZE
+ * symbols.
+ */
+int receivePackedToFile(int sock_fd, int out_fd, off_t offset, long len, struct transfer* transfer) {
+    char* buffer;
+    long i;
+    long chunk;
+    int ret;
+
+    buffer = (char*)malloc(RECV_BUFFER_SIZE);
+    ret = 1;
+    for (i = 0; i < len && ret; i += chunk) {
+        chunk = (len - i < RECV_BUFFER_SIZE) ? len - i : RECV_BUFFER_SIZE;
+        ret = recvPacked(sock_fd, buffer, chunk, transfer)
+            && writeAt(out_fd, buffer, chunk, offset + i);
+    }
+    ret = ret && recvChecksum(sock_fd, transfer);
+    if (!ret)
+        fprintf(stderr, "receivePackedToFile(): Incomplete response received\n");
+
+    free(buffer);
+    buffer = NULL;
+    return ret;
+}
+
+/**
+ * Receives a response of len bytes followed by the message terminator using
+ * the connection determined by the socket file descriptor, writing it to
+ * out_fd at offset as it arrives.
+ * 
+ * Bytes are spliced from the socket through a pipe into the file so they never
+ * pass through user space, falling back to large positional writes when the
+ * file does not support splicing or transfer checksums the bytes. The checksum
+ * trailer, if any, is verified last.
+ */
+int receiveToFile(int sock_fd, int out_fd, off_t offset, long len, struct transfer* transfer) {
+    char* buffer;
+    char terminator;
+    int pipe_fd[2];
+    int piped;
+    int spliced;
+    long i;
+    long chunk;
+    ssize_t moved;
+    ssize_t written;
+
+    buffer = NULL;
+    piped = pipe(pipe_fd) == 0;
+    spliced = piped && !(transfer && transfer->checksum);
+    i = 0;
+    while (i < len) {
+        chunk = (len - i < RECV_BUFFER_SIZE) ? len - i : RECV_BUFFER_SIZE;
+        if (!spliced) {
+            if (!buffer)
+                buffer = (char*)malloc(RECV_BUFFER_SIZE);
+            if ((moved = recvData(sock_fd, buffer, chunk, transfer)) <= 0
+                || !writeAt(out_fd, buffer, moved, offset))
+                    break;
+            offset += moved;
+            i += moved;
+            continue;
+        }
+
+        if (transfer && !waitTransfer(sock_fd, POLLIN, transfer))
+            break;
+        moved = splice(sock_fd, NULL, pipe_fd[1], NULL, chunk, SPLICE_F_MOVE);
+        if (moved < 0 && errno == EINTR)
+            continue;
+        if (moved < 0 && errno == EINVAL) {
+            spliced = 0;
+            continue;
+        }
+        if (moved <= 0)
+            break;
+        if (transfer)
+            transfer->bytes += moved;
+
+        while (moved > 0 && (written = splice(pipe_fd[0], NULL, out_fd, &offset, moved, SPLICE_F_MOVE)) > 0) {
+            moved -= written;
+            i += written;
+        }
+        if (moved > 0) {
+            // File cannot be spliced into; copy what is left in the pipe instead
+            if (!buffer)
+                buffer = (char*)malloc(RECV_BUFFER_SIZE);
+            if (read(pipe_fd[0], buffer, moved) != moved || !writeAt(out_fd, buffer, moved, offset))
+                break;
+            offset += moved;
+            i += moved;
+            spliced = 0;
+        }
+    }
+
+    if (piped) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+    }
+    free(buffer);
+    buffer = NULL;
+
+    if (i < len || recvData(sock_fd, &terminator, 1, transfer) != 1
+        || terminator != MESSAGE_TERMINATOR[0] || !recvChecksum(sock_fd, transfer)) {
+            fprintf(stderr, "receiveToFile(): Incomplete response received\n");
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Receives exactly len bytes into buffer using the connection determined by
+ * the socket file descriptor. Returns 1 if every byte arrived.
+ */
+int recvAll(int sock_fd, char* buffer, long len, struct transfer* transfer) {
+    long i;
+    int received;
+
+    i = 0;
+    while (i < len && (received = recvData(sock_fd, &buffer[i],
+            (len - i < RECV_BUFFER_SIZE) ? len - i : RECV_BUFFER_SIZE, transfer)) > 0)
+        i += received;
+    return i == len;
+}
+
+/**
+ * Receives exactly len bytes using the connection determined by the socket
+ * file descriptor into a null terminated buffer from allocBuffer().
+ * 
+ * The buffer starts small and is grown as the bytes arrive, so a length
+ * declared by the peer is never allocated up front. Returns NULL if not every
+ * byte arrived or the buffer cannot be grown.
+ */
+char* recvBuffer(int sock_fd, long len, struct transfer* transfer) {
+    long i;
+    long size;
+    int received;
+    char* buffer;
+    char* grown;
+
+    size = (len < DATA_BUFFER_SIZE) ? len + 1 : DATA_BUFFER_SIZE;
+    buffer = allocBuffer(size);
+    i = 0;
+    received = 1;
+    while (buffer && i < len && received > 0) {
+        if (i == size - 1) {
+            size = (size * 2 < len + 1) ? size * 2 : len + 1;
+            grown = growBuffer(buffer, size);
+            if (!grown)
+                releaseBuffer(buffer);
+            buffer = grown;
+        }
+        if (buffer && (received = recvData(sock_fd, &buffer[i],
+                (size - i - 1 < RECV_BUFFER_SIZE) ? size - i - 1 : RECV_BUFFER_SIZE, transfer)) > 0)
+            i += received;
+    }
+
+    if (buffer && i < len) {
+        releaseBuffer(buffer);
+        buffer = NULL;
+    }
+    if (buffer)
+        buffer[len] = '\0';
+    return buffer;
+}
+
+/**
+ * Receives the checksum trailer of a message if transfer checksums, verifying
+ * it against the bytes received. Returns 1 if it matches or there is none.
+ */
+int recvChecksum(int sock_fd, struct transfer* transfer) {
+    char trailer[CHECKSUM_SIZE];
+
+    if (!transfer || !transfer->checksum)
+        return 1;
+    return recvAll(sock_fd, trailer, CHECKSUM_SIZE, transfer) && verifyChecksum(transfer);
+}
+
+/**
+ * Receives up to len bytes into buffer using the connection determined by the
+ * socket file descriptor.
+ * 
+ * If transfer is given, the socket is first waited on so that its deadlines
+ * are enforced. Returns the number of bytes received, 0 if the peer closed the
+ * connection or -1 on failure, with errno set to ETIMEDOUT if a deadline was
+ * missed.
+ */
+int recvData(int sock_fd, char* buffer, int len, struct transfer* transfer) {
+    int received;
+
+    if (transfer && !waitTransfer(sock_fd, POLLIN, transfer))
+        return -1;
+    while ((received = recv(sock_fd, buffer, len, 0)) < 0 && errno == EINTR)
+        ;
+    if (received > 0 && transfer)
+        countReceived(transfer, buffer, received);
+    return received;
+}
+
+/**
+ * Receives len packed symbols using the connection determined by the socket
+ * file descriptor, storing them unpacked in buffer. Returns 1 if every symbol
+ * arrived.
+ * 
+ * Symbols are received in chunks of RECV_BUFFER_SIZE so that each chunk ends
+ * on a whole group of packed symbols.
+ */
+int recvPacked(int sock_fd, char* buffer, long len, struct transfer* transfer) {
+    unsigned char* packed;
+    long i;
+    long chunk;
+    int ret;
+
+    packed = (unsigned char*)malloc(packedSize(RECV_BUFFER_SIZE));
+    ret = 1;
+    for (i = 0; i < len && ret; i += chunk) {
+        chunk = (len - i < RECV_BUFFER_SIZE) ? len - i : RECV_BUFFER_SIZE;
+        ret = recvAll(sock_fd, (char*)packed, packedSize(chunk), transfer);
+        if (ret)
+            unpackText(packed, &buffer[i], chunk);
+    }
+
+    free(packed);
+    packed = NULL;
+    return ret;
+}
+
+/**
+ * Releases a buffer from allocBuffer().
+ */
+void releaseBuffer(char* buffer) {
+    struct bufferHeader* header;
+
+    if (!buffer)
+        return;
+    header = (struct bufferHeader*)buffer - 1;
+    if (header->length > 0)
+        munmap(header, header->length);
+    else
+        free(header);
+}
+
+/**
+ * Determines if a reload was requested since the last call.
+ */
+int reloadRequested(void) {
+    if (!reload_requested)
+        return 0;
+    reload_requested = 0;
+    return 1;
+}
+
+/**
+ * Hands the listening socket over to a new server process started from the
+ * same command line, which finds it through LISTEN_FD_ENV.
+ * 
+ * The new process writes to the pipe named by READY_FD_ENV once it is ready
+ * to accept connections. Returns 1 once it has, after which the caller should
+ * stop accepting and drain its workers, or 0 if it exited or did not become
+ * ready within RELOAD_TIMEOUT seconds, in which case it is stopped.
+ */
+int reloadServer(int sock_fd, char* argv[]) {
+    char value[AUTH_BUFFER_SIZE];
+    char ack;
+    int ready_fd[2];
+    int ret;
+    pid_t pid;
+    struct pollfd pfd;
+
+    if (pipe2(ready_fd, O_CLOEXEC) < 0) {
+        perror("pipe2()");
+        return 0;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        close(ready_fd[0]);
+        fcntl(ready_fd[1], F_SETFD, 0);
+        fcntl(sock_fd, F_SETFD, 0);
+        snprintf(value, sizeof(value), "%d", sock_fd);
+        setenv(LISTEN_FD_ENV, value, 1);
+        snprintf(value, sizeof(value), "%d", ready_fd[1]);
+        setenv(READY_FD_ENV, value, 1);
+        execvp(argv[0], argv);
+        perror("execvp()");
+        _exit(2);
+    }
+    close(ready_fd[1]);
+    if (pid < 0) {
+        perror("fork()");
+        close(ready_fd[0]);
+        return 0;
+    }
+
+    pfd.fd = ready_fd[0];
+    pfd.events = POLLIN;
+    while ((ret = poll(&pfd, 1, RELOAD_TIMEOUT * 1000)) < 0 && errno == EINTR)
+        ;
+    ret = ret > 0 && read(ready_fd[0], &ack, 1) == 1 && ack == ACK[0];
+    close(ready_fd[0]);
+
+    if (!ret) {
+        fprintf(stderr, "reloadServer(): New server did not become ready\n");
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return ret;
+}
+
+/**
+ * Requests the transformation of a batch frame of count records from the
+ * server at port, writing each resulting record as a line to out_fd at offset,
+ * which is advanced past them.
+ * 
+ * Records lie back to back in texts and keys, with ends holding the end offset
+ * of each in network byte order. Texts and keys travel packed if the server
+ * accepts the packed option among the requested handshake options, and both
+ * frames carry checksum trailers if it accepts the crc option.
+ */
+int requestBatch(int port, const char* auth_message, int options, const char* texts, const char* keys, const uint32_t* ends, long count, int out_fd, off_t* offset) {
+    struct sockaddr_in server_address;
+    struct transfer request;
+    struct transfer response;
+    struct iovec iov[4];
+    char header[AUTH_BUFFER_SIZE];
+    char* auth;
+    char* buffer;
+    char* lines;
+    uint32_t* table;
+    long total;
+    long start;
+    long end;
+    long i;
+    int sock_fd;
+    int accepted;
+    int ret;
+
+    initAddressStruct(&server_address, LOCALHOST, port);
+    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    auth = createHandshake(auth_message, options | OPTION_BATCH);
+    total = count ? ntohl(ends[count - 1]) : 0;
+    snprintf(header, sizeof(header), "%ld%s", count, MESSAGE_SEPERATOR);
+
+    ret = makeSocketConnection(sock_fd, (struct sockaddr*)&server_address, sizeof(server_address))
+        && sendMessage(sock_fd, auth, NULL) && authenticated(sock_fd, auth, &accepted);
+    if (ret && !(accepted & OPTION_BATCH)) {
+        fprintf(stderr, "requestBatch(): Server does not accept batch frames\n");
+        ret = 0;
+    }
+    beginTransfer(&request, 0, 0);
+    beginTransfer(&response, 0, 0);
+    request.checksum = response.checksum = ret && (accepted & OPTION_CHECKSUM);
+
+    if (ret) {
+        iov[0].iov_base = header;
+        iov[0].iov_len = strlen(header);
+        iov[1].iov_base = (char*)ends;
+        iov[1].iov_len = count * sizeof(uint32_t);
+        iov[2].iov_base = (char*)texts;
+        iov[2].iov_len = total;
+        iov[3].iov_base = (char*)keys;
+        iov[3].iov_len = total;
+        ret = ((accepted & OPTION_PACKED)
+            ? sendVector(sock_fd, iov, 2, &request) && sendPacked(sock_fd, texts, total, &request)
+                && sendPacked(sock_fd, keys, total, &request)
+            : sendVector(sock_fd, iov, 4, &request)) && sendChecksum(sock_fd, &request);
+        if (!ret)
+            perror("send()");
+    }
+
+    table = (uint32_t*)malloc(count * sizeof(uint32_t) + 1);
+    buffer = (char*)malloc(total + 1);
+    if (ret) {
+        ret = getFrameLength(sock_fd, &response) == count
+            && recvAll(sock_fd, (char*)table, count * sizeof(uint32_t), &response)
+            && memcmp(table, ends, count * sizeof(uint32_t)) == 0
+            && ((accepted & OPTION_PACKED) ? recvPacked(sock_fd, buffer, total, &response)
+                : recvAll(sock_fd, buffer, total, &response))
+            && recvChecksum(sock_fd, &response);
+        if (!ret)
+            fprintf(stderr, "requestBatch(): Incomplete response received\n");
+    }
+    close(sock_fd);
+
+    if (ret) {
+        lines = (char*)malloc(total + count);
+        for (i = 0, start = 0; i < count; i++, start = end) {
+            end = ntohl(ends[i]);
+            memcpy(&lines[start + i], &buffer[start], end - start);
+            lines[end + i] = FILE_TERMINATOR[0];
+        }
+        ret = writeAt(out_fd, lines, total + count, *offset);
+        *offset += total + count;
+
+        free(lines);
+        lines = NULL;
+    }
+
+    free(auth);
+    auth = NULL;
+    free(table);
+    table = NULL;
+    free(buffer);
+    buffer = NULL;
+    return ret;
+}
+
+/**
+ * Requests the transformation of len bytes of text using key from the server
+ * at port, streaming the result to out_fd at offset.
+ * 
+ * Text and key travel packed if the server accepts the packed option among the
+ * requested handshake options and len is at most MAX_PACKED_LENGTH, and
+ * request and response carry checksum trailers if it accepts the crc option.
+ */
+int requestRange(int port, const char* auth_message, int options, const char* text, const char* key, long len, int out_fd, off_t offset) {
+    struct sockaddr_in server_address;
+    struct transfer request;
+    struct transfer response;
+    char* auth;
+    int sock_fd;
+    int accepted;
+    int ret;
+
+    // Ranges too long for a packed request go unpacked instead
+    if (len > MAX_PACKED_LENGTH)
+        options &= ~OPTION_PACKED;
+    initAddressStruct(&server_address, LOCALHOST, port);
+    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    auth = createHandshake(auth_message, options);
+
+    ret = makeSocketConnection(sock_fd, (struct sockaddr*)&server_address, sizeof(server_address))
+        && sendMessage(sock_fd, auth, NULL) && authenticated(sock_fd, auth, &accepted);
+    beginTransfer(&request, 0, 0);
+    beginTransfer(&response, 0, 0);
+    request.checksum = response.checksum = ret && (accepted & OPTION_CHECKSUM);
+    if (ret && (accepted & OPTION_PACKED))
+        ret = sendPackedRequest(sock_fd, text, key, len, &request)
+            && receivePackedToFile(sock_fd, out_fd, offset, len, &response);
+    else if (ret)
+        ret = sendRequest(sock_fd, text, key, len, &request)
+            && receiveToFile(sock_fd, out_fd, offset, len, &response);
+    close(sock_fd);
+
+    free(auth);
+    auth = NULL;
+    return ret;
+}
+
+/**
+ * Sends the checksum trailer of a message if transfer checksums, holding the
+ * CRC32C of the bytes sent so far in little-endian order so that the
+ * receiver's checksum over them and the trailer comes to CHECKSUM_RESIDUE.
+ */
+int sendChecksum(int sock_fd, struct transfer* transfer) {
+    unsigned char trailer[CHECKSUM_SIZE];
+    int i;
+
+    if (!transfer || !transfer->checksum)
+        return 1;
+    for (i = 0; i < CHECKSUM_SIZE; i++)
+        trailer[i] = transfer->crc >> (8 * i);
+    return sendData(sock_fd, (char*)trailer, CHECKSUM_SIZE, transfer);
+}
+
+/**
+ * Attempts to send len bytes of data over the connection determined by the
+ * socket file descriptor, enforcing the deadlines of transfer if given.
+ * 
+ * Returns 1 once every byte is sent or 0 on failure, with errno set to
+ * ETIMEDOUT if a deadline was missed.
+ */
+int sendData(int sock_fd, const char* data, long len, struct transfer* transfer) {
+    long i;
+    ssize_t sent;
+
+    i = 0;
+    while (i < len) {
+        if (transfer && !waitTransfer(sock_fd, POLLOUT, transfer))
+            return 0;
+        sent = send(sock_fd, &data[i], len - i, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EINTR)
+            return 0;
+        if (sent > 0 && transfer) {
+            transfer->bytes += sent;
+            if (transfer->checksum)
+                transfer->crc = crc32c(transfer->crc, &data[i], sent);
+        }
+        if (sent > 0)
+            i += sent;
+    }
+    return 1;
+}
+
+/**
+ * Attempts to send message over the connection determined by the socket file
+ * descriptor.
+ */
+int sendMessage(int sock_fd, const char* message, struct transfer* transfer) {
+    int err;
+
+    if (!sendData(sock_fd, message, strlen(message), transfer)) {
+        err = errno;
+        perror("send()");
+        errno = err;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Sends len characters of source packed into 5-bit symbols over the connection
+ * determined by the socket file descriptor.
+ */
+int sendPacked(int sock_fd, const char* source, long len, struct transfer* transfer) {
+    unsigned char* packed;
+    long i;
+    long chunk;
+    int ret;
+
+    packed = (unsigned char*)malloc(packedSize(RECV_BUFFER_SIZE));
+    ret = 1;
+    for (i = 0; i < len && ret; i += chunk) {
+        chunk = (len - i < RECV_BUFFER_SIZE) ? len - i : RECV_BUFFER_SIZE;
+        packText(&source[i], packed, chunk);
+        ret = sendData(sock_fd, (char*)packed, packedSize(chunk), transfer);
+    }
+
+    free(packed);
+    packed = NULL;
+    return ret;
+}
+
+/**
+ * Sends len symbols of text and key packed into 5-bit symbols over the
+ * connection determined by the socket file descriptor, headed by the symbol
+ * count and followed by the checksum trailer if transfer checksums.
+ */
+int sendPackedRequest(int sock_fd, const char* text, const char* key, long len, struct transfer* transfer) {
+    char header[AUTH_BUFFER_SIZE];
+
+    snprintf(header, sizeof(header), "%ld%s", len, MESSAGE_SEPERATOR);
+    if (!sendData(sock_fd, header, strlen(header), transfer) || !sendPacked(sock_fd, text, len, transfer)
+        || !sendPacked(sock_fd, key, len, transfer) || !sendChecksum(sock_fd, transfer)) {
+            perror("send()");
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Sends len bytes of text and key as a single request message over the
+ * connection determined by the socket file descriptor without first copying
+ * them into one buffer, followed by the checksum trailer if transfer
+ * checksums.
+ */
+int sendRequest(int sock_fd, const char* text, const char* key, long len, struct transfer* transfer) {
+    struct iovec iov[4];
+    int err;
+
+    iov[0].iov_base = (char*)text;
+    iov[0].iov_len = len;
+    iov[1].iov_base = MESSAGE_SEPERATOR;
+    iov[1].iov_len = strlen(MESSAGE_SEPERATOR);
+    iov[2].iov_base = (char*)key;
+    iov[2].iov_len = len;
+    iov[3].iov_base = MESSAGE_TERMINATOR;
+    iov[3].iov_len = strlen(MESSAGE_TERMINATOR);
+
+    if (!sendVector(sock_fd, iov, 4, transfer) || !sendChecksum(sock_fd, transfer)) {
+        err = errno;
+        perror("sendmsg()");
+        errno = err;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Attempts to send every buffer of iov in order over the connection determined
+ * by the socket file descriptor, enforcing the deadlines of transfer if given.
+ * 
+ * iov is advanced in place as bytes are sent. Returns 1 once every byte is sent
+ * or 0 on failure.
+ */
+int sendVector(int sock_fd, struct iovec* iov, int count, struct transfer* transfer) {
+    struct msghdr msg;
+    ssize_t sent;
+
+    memset(&msg, '\0', sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    while (msg.msg_iovlen > 0) {
+        if (transfer && !waitTransfer(sock_fd, POLLOUT, transfer))
+            return 0;
+        sent = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        if (transfer)
+            transfer->bytes += sent;
+
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            if (transfer && transfer->checksum)
+                transfer->crc = crc32c(transfer->crc, msg.msg_iov->iov_base, msg.msg_iov->iov_len);
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            if (transfer && transfer->checksum)
+                transfer->crc = crc32c(transfer->crc, msg.msg_iov->iov_base, sent);
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Disables Nagle's algorithm on the socket so small pipelined frames are sent
+ * without waiting on acknowledgement of earlier ones.
+ */
+void setNoDelay(int sock_fd) {
+    int enable;
+
+    enable = 1;
+    if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0)
+        perror("setsockopt()");
+}
+
+/**
+ * Lets several listening sockets bind the same port, with the kernel spreading
+ * incoming connections across them.
+ */
+int setReusePort(int sock_fd) {
+    int enable;
+
+    enable = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        perror("setsockopt()");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Forks a listener process for each of count shards, confined to the CPUs of
+ * the matching NUMA node in nodes, and returns in each the shard it serves.
+ * 
+ * The calling process stays behind to supervise the listeners, which are
+ * killed along with it, passing on requests for statistics. Returns -1 to it
+ * once every listener has exited.
+ */
+int shardListeners(const cpu_set_t* nodes, int count) {
+    int i;
+    int shard;
+    int status;
+    pid_t parent;
+    pid_t pid;
+    pid_t shards[MAX_NUMA_NODES];
+
+    parent = getpid();
+    for (shard = 0; shard < count && shard < MAX_NUMA_NODES; shard++) {
+        pid = fork();
+        if (pid == 0) {
+            if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != parent)
+                _exit(2);
+            if (sched_setaffinity(0, sizeof(nodes[shard]), &nodes[shard]) < 0)
+                perror("sched_setaffinity()");
+            return shard;
+        }
+        if (pid < 0)
+            perror("fork()");
+        shards[shard] = pid;
+    }
+
+    while ((pid = wait(&status)) > 0 || errno == EINTR) {
+        if (statsRequested()) {
+            for (i = 0; i < shard; i++) {
+                if (shards[i] > 0)
+                    kill(shards[i], SIGUSR1);
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Applies len packed symbols of key to len packed symbols of text, storing the
+ * packed result in buffer. Key symbols are added modulo the size of the
+ * allowed character set, or subtracted if decrypt is set.
+ * 
+ * Symbols are processed eight at a time in the byte lanes of a 64-bit word
+ * without being unpacked to characters.
+ */
+void shiftPacked(const unsigned char* text, const unsigned char* key, unsigned char* buffer, long len, int decrypt) {
+    unsigned char tail[3][5];
+    long i;
+    uint64_t text_lanes;
+    uint64_t key_lanes;
+
+    for (i = 0; i < len; i += 8) {
+        if (len - i >= 8) {
+            text_lanes = spreadLanes(loadGroup(&text[i / 8 * 5]));
+            key_lanes = spreadLanes(loadGroup(&key[i / 8 * 5]));
+        } else {
+            memset(tail, '\0', sizeof(tail));
+            memcpy(tail[0], &text[i / 8 * 5], packedSize(len - i));
+            memcpy(tail[1], &key[i / 8 * 5], packedSize(len - i));
+            text_lanes = spreadLanes(loadGroup(tail[0]));
+            key_lanes = spreadLanes(loadGroup(tail[1]));
+        }
+
+        text_lanes = decrypt ? text_lanes + LANE_MODULUS - key_lanes : text_lanes + key_lanes;
+        text_lanes = gatherLanes(reduceLanes(text_lanes));
+
+        if (len - i >= 8) {
+            storeGroup(&buffer[i / 8 * 5], text_lanes);
+        } else {
+            storeGroup(tail[2], text_lanes);
+            memcpy(&buffer[i / 8 * 5], tail[2], packedSize(len - i));
+        }
+    }
+}
+
+/**
+ * Tells the server that handed down its listening socket, if any, that this
+ * one is ready to accept connections in its place.
+ */
+void signalReady(void) {
+    char* value;
+    int fd;
+
+    value = getenv(READY_FD_ENV);
+    if (!value)
+        return;
+    fd = atoi(value);
+    unsetenv(READY_FD_ENV);
+    if (write(fd, ACK, 1) != 1)
+        perror("write()");
+    close(fd);
+}
+
+/**
+ * Determines if a statistics report was requested since the last call.
+ */
+int statsRequested(void) {
+    if (!stats_requested)
+        return 0;
+    stats_requested = 0;
+    return 1;
+}
+
+/**
+ * Determines if s is at least as long as len.
  */
-int sufficientLength(const char* s, int len) {
+int sufficientLength(const char* s, long len) {
     if (strlen(s) < len) {
         fprintf(stderr, "sufficientLength(): String is shorter than expected length\n");
         return 0;
     }
     return 1;
+}
+
+/**
+ * Appends a record of the request started with beginTrace() to the trace, if
+ * any, now that it has been answered with status.
+ * 
+ * len is the number of characters and records the number of records of a
+ * batch frame, or 0 for a single message.
+ */
+void traceRequest(struct trace* trace, long len, long records, int options, int status) {
+    struct traceRecord record;
+    struct timespec now;
+
+    if (trace->fd < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&record, '\0', sizeof(record));
+    record.start = trace->start.tv_sec * 1000000000ULL + trace->start.tv_nsec;
+    record.duration = ((now.tv_sec - trace->start.tv_sec) * 1000000000LL
+        + (now.tv_nsec - trace->start.tv_nsec)) / 1000;
+    record.connection = trace->connection;
+    record.length = len;
+    record.records = records;
+    record.sequence = trace->sequence++;
+    record.concurrency = trace->concurrency;
+    record.mode = trace->mode;
+    record.options = options;
+    record.status = status;
+    if (write(trace->fd, &record, sizeof(record)) != sizeof(record))
+        perror("write()");
+}
+
+/**
+ * Determines if transfer has run past its deadline or, once its grace period
+ * is over, has fallen below its minimum throughput.
+ */
+int transferExpired(struct transfer* transfer) {
+    long elapsed;
+
+    elapsed = elapsedMs(&transfer->start);
+    if (transfer->limit && elapsed >= transfer->limit * 1000L)
+        return 1;
+    if (transfer->min_rate && elapsed >= THROUGHPUT_GRACE * 1000L
+        && transfer->bytes * 1000L / elapsed < transfer->min_rate)
+            return 1;
+    return 0;
+}
+
+/**
+ * Unpacks len 5-bit symbols from packed into characters of the allowed
+ * character set stored in buffer, reversing packText().
+ */
+void unpackText(const unsigned char* packed, char* buffer, long len) {
+    char tail[8];
+    long i;
+    uint64_t lanes;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        lanes = charLanes(spreadLanes(loadGroup(&packed[i / 8 * 5])));
+        memcpy(&buffer[i], &lanes, 8);
+    }
+    if (i < len) {
+        lanes = 0;
+        memcpy(&lanes, &packed[i / 8 * 5], packedSize(len - i));
+        lanes = charLanes(spreadLanes(lanes));
+        memcpy(tail, &lanes, 8);
+        memcpy(&buffer[i], tail, len - i);
+    }
+}
+
+/**
+ * Determines if the bytes received in transfer, ending with a checksum
+ * trailer, are intact. Transfers without checksums always are.
+ */
+int verifyChecksum(const struct transfer* transfer) {
+    if (!transfer || !transfer->checksum || transfer->crc == CHECKSUM_RESIDUE)
+        return 1;
+    fprintf(stderr, "verifyChecksum(): Checksum mismatch\n");
+    return 0;
+}
+
+/**
+ * Waits until the socket is ready for events without missing the deadlines of
+ * transfer or going quiet for longer than STALL_TIMEOUT seconds.
+ * 
+ * Returns 1 if the socket is ready or 0 otherwise, with errno set to
+ * ETIMEDOUT if a deadline was missed.
+ */
+int waitTransfer(int sock_fd, short events, struct transfer* transfer) {
+    struct pollfd pfd;
+    long remaining;
+    int timeout;
+    int ready;
+
+    // Transfers without deadlines, kept by clients only to checksum, leave the
+    // waiting to the blocking call that follows
+    if (!transfer->limit && !transfer->min_rate)
+        return 1;
+
+    pfd.fd = sock_fd;
+    pfd.events = events;
+    do {
+        if (transferExpired(transfer)) {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        timeout = STALL_TIMEOUT * 1000;
+        if (transfer->limit) {
+            remaining = transfer->limit * 1000L - elapsedMs(&transfer->start);
+            if (remaining < timeout)
+                timeout = remaining > 0 ? remaining : 0;
+        }
+        ready = poll(&pfd, 1, timeout);
+    } while (ready < 0 && errno == EINTR);
+
+    if (ready == 0) {
+        errno = ETIMEDOUT;
+        return 0;
+    }
+    return ready > 0;
+}
+
+/**
+ * Writes len bytes of data to the file determined by fd starting at offset
+ * without moving its file position.
+ * 
+ * Pipes and terminals cannot be written positionally and are written in order
+ * instead, so they only suit a single sequential writer.
+ */
+int writeAt(int fd, const char* data, long len, off_t offset) {
+    long i;
+    ssize_t written;
+
+    i = 0;
+    while (i < len) {
+        written = pwrite(fd, &data[i], len - i, offset + i);
+        if (written < 0 && errno == ESPIPE)
+            written = write(fd, &data[i], len - i);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pwrite()");
+            return 0;
+        }
+        i += written;
+    }
+    return 1;
 }
\ No newline at end of file
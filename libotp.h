@@ -2,23 +2,82 @@
 #define __LIBOTP_H__
 
 #include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #define ACK "\6"
-#define AUTH_BUFFER_SIZE 32
+#define AFFINITY_BENCH_ROUNDS 8
+#define AFFINITY_BENCH_SIZE 16777216
+#define AUTH_BUFFER_SIZE 64
+#define BATCH_BUFFER_SIZE 1048576
 #define BUFFER_THRESHOLD 0.9
+#define BULK_CHUNK_SIZE 262144
+#define BULK_NICENESS 10
+#define BULK_THRESHOLD 1048576
+#define BULK_WAIT_TIMEOUT 120
+#define CHECKSUM_RESIDUE 0x48674BC7U
+#define CHECKSUM_SIZE 4
+#define CONN_CONNECTING 0
+#define CONN_FAILED 3
+#define CONN_HANDSHAKE 1
+#define CONN_READY 2
+#define CPU_LIST_BUFFER_SIZE 1024
+#define CRC32C_POLYNOMIAL 0x82F63B78U
 #define DATA_BUFFER_SIZE 2048
 #define DEC_AUTH_MESSAGE "$dec"
 #define ENC_AUTH_MESSAGE "$enc"
+#define EXIT_TIMEOUT 3
 #define FILE_TERMINATOR "\n"
+#define HANDSHAKE_TIMEOUT 5
+#define HUGE_BUFFER_THRESHOLD 4194304
+#define HUGE_PAGE_SIZE 2097152
+#define KEEPALIVE_TIMEOUT 10
+#define LANE_ASCII 0x4141414141414141ULL
+#define LANE_BIAS 0x1A1A1A1A1A1A1A1AULL
+#define LANE_BULK 2
+#define LANE_HIGH_BITS 0x8080808080808080ULL
+#define LANE_IDLE 3
+#define LANE_MASK 0x1F1F1F1F1F1F1F1FULL
+#define LANE_MODULUS 0x1B1B1B1B1B1B1B1BULL
+#define LANE_POLL_INTERVAL 100
+#define LANE_QUEUED 1
+#define LANE_SMALL 0
+#define LISTEN_FD_ENV "OTP_LISTEN_FD"
 #define LOCALHOST "127.0.0.1"
+#define MAX_BATCH_RECORDS 65536
+#define MAX_BULK_PROCESSES 128
+#define MAX_BULK_WORKERS 64
 #define MAX_CONCURRENT_PROCESSES 5
+#define MAX_IDLE_PROCESSES 32
+#define MAX_NUMA_NODES 64
+#define MAX_PACKED_LENGTH 1073741824
 #define MAX_QUEUE_SIZE 10
 #define MESSAGE_SEPERATOR "\17"
 #define MESSAGE_TERMINATOR "$"
+#define MIN_THROUGHPUT 16384
 #define NAK "\15"
+#define NODE_SYSFS_PATH "/sys/devices/system/node"
 #define NUM_ASCII_CHARS 128
+#define OPTION_BATCH 2
+#define OPTION_CHECKSUM 8
+#define OPTION_KEEPALIVE 4
+#define OPTION_PACKED 1
+#define OPTION_SEPERATOR ";"
+#define OTP_DECRYPT 1
+#define OTP_ENCRYPT 0
 #define PATH_BUFFER_SIZE 256
+#define RANGE_ALIGNMENT 65536
+#define READY_FD_ENV "OTP_READY_FD"
+#define REAP_BATCH_SIZE 64
+#define RECV_BUFFER_SIZE 65536
+#define RELOAD_TIMEOUT 10
+#define STALL_TIMEOUT 10
+#define THROUGHPUT_GRACE 2
 
 static const char ALLOWED_CHARS[] = { 'A', 'B', 'C', 'D', 'E',
                                       'F', 'G', 'H', 'I', 'J',
@@ -27,28 +86,291 @@ static const char ALLOWED_CHARS[] = { 'A', 'B', 'C', 'D', 'E',
                                       'U', 'V', 'W', 'X', 'Y',
                                       'Z', ' ' };
 
-int authenticate(int, char*);
-int authenticated(int, char*);
+/**
+ * Options a client may request after its authentication message, each
+ * enabling the OPTION_ flag of the same position. The server acknowledges the
+ * options it accepts in the same way.
+ */
+static const char* const HANDSHAKE_OPTIONS[] = { "pack", "batch", "keep", "crc" };
+
+/**
+ * Bookkeeping for one phase of a socket exchange (handshake, request body or
+ * response drain).
+ * 
+ * limit is the phase deadline in seconds and min_rate the minimum average
+ * throughput in bytes per second once THROUGHPUT_GRACE has passed; 0 disables
+ * either check. If checksum is set, crc accumulates the CRC32C of every byte
+ * sent or received during the phase.
+ */
+struct transfer {
+    struct timespec start;
+    long bytes;
+    int limit;
+    int min_rate;
+    int checksum;
+    uint32_t crc;
+};
+
+/**
+ * Completion callback of an asynchronous request, given the argument passed
+ * along with the request, a status of 0 on success or -1 on failure and the
+ * null terminated result of len characters. The result is only valid for the
+ * duration of the call.
+ */
+typedef void (*otp_callback)(void*, int, const char*, long);
+
+/**
+ * Transform of len characters, or len packed symbols if the last argument is
+ * set, of text with key into buffer, as done by the servers' workers.
+ */
+typedef void (*otp_transform)(const char*, const char*, char*, long, int);
+
+/**
+ * Request awaiting its response on a connection.
+ */
+struct otp_request {
+    otp_callback callback;
+    void* arg;
+    long len;
+    struct otp_request* next;
+};
+
+/**
+ * Non-blocking client connection to an encryption or decryption server.
+ * 
+ * Requests are written as single-record batch frames on a keep-alive
+ * connection so any number may be in flight; responses arrive and complete
+ * them in the order they were made. out and in buffer bytes still to be sent
+ * and received bytes not yet parsed, and result holds the result handed to
+ * the completion callback.
+ */
+struct otp_conn {
+    int fd;
+    int mode;
+    int options;
+    int state;
+    char* out;
+    long out_sent;
+    long out_len;
+    long out_size;
+    char* in;
+    long in_start;
+    long in_len;
+    long in_size;
+    char* result;
+    long result_size;
+    long pending;
+    struct otp_request* head;
+    struct otp_request* tail;
+};
+
+/**
+ * Fixed set of connections to one server over which requests are spread,
+ * with failed connections replaced as they are handed out.
+ */
+struct otp_pool {
+    int port;
+    int mode;
+    int options;
+    int size;
+    struct otp_conn** conns;
+    struct pollfd* fds;
+};
+
+/**
+ * Header kept in front of every buffer handed out by allocBuffer().
+ * 
+ * size is the number of usable bytes following it and length the length of
+ * the mapping holding both, or 0 if the buffer came from malloc().
+ */
+struct bufferHeader {
+    long size;
+    long length;
+};
+
+/**
+ * Lane a worker has moved into, as reported to the server.
+ */
+struct laneChange {
+    pid_t pid;
+    int lane;
+};
+
+/**
+ * Lanes a server schedules its workers in by request size.
+ * 
+ * Workers start out in the small lane, whose budget is
+ * MAX_CONCURRENT_PROCESSES, and report through the change pipe as soon as
+ * their request is known to be at least BULK_THRESHOLD bytes. Up to
+ * bulk_processes of them are then no longer counted against the small lane,
+ * and only bulk_workers, one per usable CPU, transform at a time, each holding
+ * one of the tokens in the token pipe until the server reaps it. Up to
+ * MAX_IDLE_PROCESSES workers waiting for the next request on a keep-alive
+ * connection are not counted against the small lane either.
+ * 
+ * lane is the lane of the worker holding this copy; moved lists the workers
+ * the server knows to have left the small lane. The notice pipe is written to
+ * whenever a worker exits.
+ */
+struct lanes {
+    int change_fd[2];
+    int token_fd[2];
+    int notice_fd[2];
+    int lane;
+    int bulk_workers;
+    int bulk_processes;
+    int num_moved;
+    struct laneChange moved[MAX_CONCURRENT_PROCESSES + MAX_BULK_PROCESSES + MAX_IDLE_PROCESSES];
+};
+
+/**
+ * Counters kept by a server for the workers it has forked.
+ */
+struct serverStats {
+    long accepted;
+    long bulk;
+    long completed;
+    long failed;
+    long timeouts;
+};
+
+/**
+ * Trace a server appends a traceRecord to for every request its workers
+ * answer or fail, or fd -1 if it does not trace.
+ * 
+ * connection and concurrency describe the connection a worker was forked for,
+ * sequence counts the requests answered on it and start is when the current
+ * one started to arrive.
+ */
+struct trace {
+    int fd;
+    int mode;
+    uint32_t connection;
+    uint16_t concurrency;
+    uint16_t sequence;
+    struct timespec start;
+};
+
+/**
+ * Fixed-size trace record of one request, in host byte order.
+ * 
+ * start is the CLOCK_MONOTONIC time in nanoseconds at which the request
+ * started to arrive and duration the microseconds until its response was sent.
+ * records is the number of records of a batch frame, or 0 for a single
+ * message, and length the number of characters across them. concurrency is
+ * the number of workers in flight when the connection was accepted, counting
+ * its own, and status the exit status the request would give its worker.
+ */
+struct traceRecord {
+    uint64_t start;
+    uint32_t duration;
+    uint32_t connection;
+    uint32_t length;
+    uint32_t records;
+    uint16_t sequence;
+    uint16_t concurrency;
+    uint8_t mode;
+    uint8_t options;
+    uint8_t status;
+    uint8_t reserved;
+};
+
+int admitWorker(const struct lanes*, int);
+char* allocBuffer(long);
+int authenticate(int, char*, struct transfer*, int*);
+int authenticated(int, char*, int*);
 int allowedChars(char*);
+int allowedRecords(char*);
+int awaitConnection(int, struct lanes*);
+int awaitRequest(int, struct lanes*);
+int batchRequest(int, const char*, int, const char*, const char*, int, off_t*);
+long batchSize(const uint32_t*, long);
+void beginTrace(struct trace*);
+void beginTransfer(struct transfer*, int, int);
+int benchmarkAffinity(otp_transform);
 char* concatenate(const char*, const char*);
 int connected(int);
 int connectClient(int, struct sockaddr*, socklen_t*);
 int connectSocket(int, struct sockaddr*);
+uint32_t crc32c(uint32_t, const char*, long);
 int* createAllowedCharsHash(void);
+int createFileDesc(char*, char*);
+char* createHandshake(const char*, int);
 char* createPath(char*, char*);
+long elapsedMs(const struct timespec*);
+int enterBulkLane(struct lanes*, struct transfer*);
+int failureStatus(void);
+char* getFileContents(int);
 char* getFileData(int);
 int getFileDesc(char*, char*);
+long getFrameLength(int, struct transfer*);
 char* getKey(const char*, char*);
-int getKeyLength(const char*);
-char* getResponse(int);
+long getKeyLength(const char*);
+int getNodeCpus(cpu_set_t*, int);
+char* getResponse(int, struct transfer*, struct lanes*);
 char* getText(const char*, char*);
-int getTextLength(const char*);
+long getTextLength(const char*);
+char* growBuffer(char*, long);
+int inheritListener(int*);
 void initAddressStruct(struct sockaddr_in*, char*, int);
+int initLanes(struct lanes*);
+int installReloadHandler(void);
+int installStatsHandler(void);
 int locatedFile(int);
 int makeSocketConnection(int, struct sockaddr*, int);
-int reachedThreshold(int, int);
-char* resize(char*, int);
-int sendMessage(int, const char*);
-int sufficientLength(const char*, int);
+int openTrace(struct trace*, const char*, int);
+void otp_close(struct otp_conn*);
+struct otp_conn* otp_connect(int, int, int);
+int otp_decrypt_async(struct otp_conn*, const char*, const char*, long, otp_callback, void*);
+int otp_encrypt_async(struct otp_conn*, const char*, const char*, long, otp_callback, void*);
+short otp_events(struct otp_conn*);
+int otp_fd(struct otp_conn*);
+long otp_pending(struct otp_conn*);
+struct otp_pool* otp_pool_create(int, int, int, int);
+void otp_pool_destroy(struct otp_pool*);
+struct otp_conn* otp_pool_get(struct otp_pool*);
+long otp_pool_poll(struct otp_pool*, int);
+int otp_process(struct otp_conn*, short);
+long packedSize(long);
+void packText(const char*, unsigned char*, long);
+int parallelRequest(int, const char*, int, const char*, const char*, long, int, int, off_t);
+int parseCpuList(const char*, cpu_set_t*);
+int parseOptions(const char*);
+int pinWorker(const cpu_set_t*, long);
+void printStats(const struct serverStats*);
+int reachedThreshold(long, long);
+int reapWorkers(struct serverStats*, struct lanes*, int);
+int receivePackedToFile(int, int, off_t, long, struct transfer*);
+int receiveToFile(int, int, off_t, long, struct transfer*);
+int recvAll(int, char*, long, struct transfer*);
+char* recvBuffer(int, long, struct transfer*);
+int recvChecksum(int, struct transfer*);
+int recvData(int, char*, int, struct transfer*);
+int recvPacked(int, char*, long, struct transfer*);
+void releaseBuffer(char*);
+int reloadRequested(void);
+int reloadServer(int, char*[]);
+int requestBatch(int, const char*, int, const char*, const char*, const uint32_t*, long, int, off_t*);
+int requestRange(int, const char*, int, const char*, const char*, long, int, off_t);
+int sendChecksum(int, struct transfer*);
+int sendData(int, const char*, long, struct transfer*);
+int sendMessage(int, const char*, struct transfer*);
+int sendPacked(int, const char*, long, struct transfer*);
+int sendPackedRequest(int, const char*, const char*, long, struct transfer*);
+int sendRequest(int, const char*, const char*, long, struct transfer*);
+int sendVector(int, struct iovec*, int, struct transfer*);
+void setNoDelay(int);
+int setReusePort(int);
+int shardListeners(const cpu_set_t*, int);
+void shiftPacked(const unsigned char*, const unsigned char*, unsigned char*, long, int);
+void signalReady(void);
+int statsRequested(void);
+int sufficientLength(const char*, long);
+void traceRequest(struct trace*, long, long, int, int);
+int transferExpired(struct transfer*);
+void unpackText(const unsigned char*, char*, long);
+int verifyChecksum(const struct transfer*);
+int waitTransfer(int, short, struct transfer*);
+int writeAt(int, const char*, long, off_t);
 
 #endif /* __LIBOTP_H__ */
\ No newline at end of file
@@ -0,0 +1,462 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "otp_replay.h"
+#include "libotp.h"
+
+/**
+ * Driver for the trace replay tool.
+ * 
+ * The trace written by a server started with -t is replayed against the server
+ * at each given port in turn, opening connections and sending requests of the
+ * recorded sizes, options and reuse at their recorded times divided by the
+ * speed. Texts and keys are synthetic. The latency distribution seen against
+ * each server is reported, followed by the change from the baseline port to
+ * the first port if both are given.
+ */
+int main(int argc, char* argv[]) {
+    double speed;
+    int opt;
+
+    speed = 1.0;
+    while ((opt = getopt(argc, argv, "x:")) != -1) {
+        switch (opt) {
+            case 'x':
+                speed = atof(optarg);
+                break;
+            default:
+                speed = 0;
+                break;
+        }
+    }
+    if (speed <= 0 || argc - optind < 2 || argc - optind > 3) {
+        fprintf(stderr, "Usage: %s [-x speed] <trace file> <port> [<baseline port>]\n", argv[0]);
+        exit(1);
+    }
+
+    struct traceRecord* records;
+    struct replayResult* results[2];
+    char* payload;
+    long count;
+    long counts[2];
+    long max_len;
+    long i;
+    int num_ports;
+
+    records = loadTrace(argv[optind], &count);
+    if (!records)
+        exit(2);
+    if (count == 0) {
+        fprintf(stderr, "%s: Trace holds no requests\n", argv[optind]);
+        exit(2);
+    }
+    printTrace(records, count);
+
+    // Every request uses the same synthetic characters as text and key
+    max_len = 0;
+    for (i = 0; i < count; i++) {
+        if (records[i].length > max_len)
+            max_len = records[i].length;
+    }
+    payload = allocBuffer(max_len + 1);
+    srand(time(NULL));
+    for (i = 0; i < max_len; i++)
+        payload[i] = ALLOWED_CHARS[rand() % sizeof(ALLOWED_CHARS)];
+    payload[max_len] = '\0';
+
+    num_ports = argc - optind - 1;
+    for (i = 0; i < num_ports; i++) {
+        counts[i] = replayTrace(records, count, atoi(argv[optind + 1 + i]), speed, payload, &results[i]);
+        if (counts[i] < 0)
+            exit(2);
+        printLatencies(argv[optind + 1 + i], results[i], counts[i]);
+    }
+    if (num_ports == 2)
+        compareLatencies(results[1], counts[1], results[0], counts[0]);
+
+    for (i = 0; i < num_ports; i++) {
+        free(results[i]);
+        results[i] = NULL;
+    }
+    releaseBuffer(payload);
+    payload = NULL;
+    free(records);
+    records = NULL;
+    exit(0);
+}
+
+/**
+ * Orders replay connections by the time they started.
+ */
+int compareConnections(const void* a, const void* b) {
+    const struct replayConnection* x = a;
+    const struct replayConnection* y = b;
+
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/**
+ * Orders latencies, shortest first.
+ */
+int compareLatency(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Writes the change in latency percentiles between the baseline results and
+ * the results of the server under test to standard output.
+ */
+void compareLatencies(struct replayResult* baseline, long baseline_count, struct replayResult* results, long count) {
+    static const double percentiles[] = { 0.5, 0.9, 0.99, 1.0 };
+    uint32_t before;
+    uint32_t after;
+    int i;
+
+    printf("change:");
+    for (i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++) {
+        before = percentileLatency(baseline, baseline_count, percentiles[i]);
+        after = percentileLatency(results, count, percentiles[i]);
+        printf(" p%g %+.1f%%", percentiles[i] * 100, before ? (after - (double)before) * 100 / before : 0.0);
+    }
+    printf("\n");
+}
+
+/**
+ * Orders trace records by connection and then by the time they started, so
+ * that the requests of every connection lie together in order.
+ */
+int compareRecords(const void* a, const void* b) {
+    const struct traceRecord* x = a;
+    const struct traceRecord* y = b;
+
+    if (x->connection != y->connection)
+        return (x->connection > y->connection) - (x->connection < y->connection);
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/**
+ * Reads every record of the trace at path, sorted by compareRecords(), and
+ * stores their number in count. Returns NULL on failure.
+ */
+struct traceRecord* loadTrace(const char* path, long* count) {
+    struct traceRecord* records;
+    struct stat info;
+    long size;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        perror("open()");
+        return NULL;
+    }
+    *count = info.st_size / sizeof(struct traceRecord);
+    size = *count * sizeof(struct traceRecord);
+    records = (struct traceRecord*)malloc(size + 1);
+    if (read(fd, records, size) != size) {
+        perror("read()");
+        close(fd);
+        free(records);
+        return NULL;
+    }
+    close(fd);
+
+    qsort(records, *count, sizeof(struct traceRecord), compareRecords);
+    return records;
+}
+
+/**
+ * Gets the latency in microseconds at or below which the fraction p of the
+ * results, sorted by latency, lie.
+ */
+uint32_t percentileLatency(struct replayResult* results, long count, double p) {
+    long i;
+
+    if (count == 0)
+        return 0;
+    i = (long)(p * count + 0.5) - 1;
+    if (i < 0)
+        i = 0;
+    if (i >= count)
+        i = count - 1;
+    return results[i].latency;
+}
+
+/**
+ * Writes the number of requests replayed against the server at the port
+ * named by label, how many failed and their latency percentiles to standard
+ * output. The results are sorted by latency in place.
+ */
+void printLatencies(const char* label, struct replayResult* results, long count) {
+    long failed;
+    long i;
+
+    failed = 0;
+    for (i = 0; i < count; i++) {
+        if (!results[i].ok)
+            failed++;
+    }
+    qsort(results, count, sizeof(struct replayResult), compareLatency);
+    printf("port %s: %ld requests, %ld failed, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+        label, count, failed, percentileLatency(results, count, 0.5) / 1000.0,
+        percentileLatency(results, count, 0.9) / 1000.0, percentileLatency(results, count, 0.99) / 1000.0,
+        percentileLatency(results, count, 1.0) / 1000.0);
+}
+
+/**
+ * Writes the number of requests, connections and characters in the trace,
+ * how many of the requests failed, the time it spans and its peak concurrency
+ * to standard output.
+ */
+void printTrace(const struct traceRecord* records, long count) {
+    uint64_t first;
+    uint64_t last;
+    long connections;
+    long chars;
+    long failed;
+    long i;
+    int peak;
+
+    first = records[0].start;
+    last = records[0].start;
+    connections = 0;
+    chars = 0;
+    failed = 0;
+    peak = 0;
+    for (i = 0; i < count; i++) {
+        if (i == 0 || records[i].sequence == 0 || records[i].connection != records[i - 1].connection)
+            connections++;
+        if (records[i].start < first)
+            first = records[i].start;
+        if (records[i].start > last)
+            last = records[i].start;
+        if (records[i].concurrency > peak)
+            peak = records[i].concurrency;
+        if (records[i].status != 0)
+            failed++;
+        chars += records[i].length;
+    }
+    printf("trace: %ld requests over %ld connections, %ld characters, %ld failed, %.3f s, peak concurrency %d\n",
+        count, connections, chars, failed, (last - first) / 1e9, peak);
+}
+
+/**
+ * Replays the count requests of one connection from records against the
+ * server at port, each no earlier than its recorded time after base divided
+ * by speed, counting from t0. A result is appended to results_fd for each.
+ * 
+ * Single messages are sent over connections of their own, as recorded;
+ * batch frames share one connection.
+ */
+void replayConnection(const struct traceRecord* records, long count, int port, double speed, const struct timespec* t0, uint64_t base, const char* payload, int results_fd) {
+    struct sockaddr_in server_address;
+    struct replayResult result;
+    struct timespec due;
+    struct timespec start;
+    struct timespec end;
+    const char* auth_message;
+    char* auth;
+    int sock_fd;
+    int accepted;
+    int connected;
+    int null_fd;
+    long i;
+
+    auth_message = (records[0].mode == OTP_DECRYPT) ? DEC_AUTH_MESSAGE : ENC_AUTH_MESSAGE;
+    null_fd = open("/dev/null", O_WRONLY);
+    sock_fd = -1;
+    auth = NULL;
+    connected = 0;
+    if (records[0].records > 0) {
+        initAddressStruct(&server_address, LOCALHOST, port);
+        sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+        auth = createHandshake(auth_message, records[0].options | OPTION_BATCH);
+        connected = makeSocketConnection(sock_fd, (struct sockaddr*)&server_address, sizeof(server_address))
+            && sendMessage(sock_fd, auth, NULL) && authenticated(sock_fd, auth, &accepted)
+            && (accepted & OPTION_BATCH);
+        if (connected && (accepted & OPTION_KEEPALIVE))
+            setNoDelay(sock_fd);
+    }
+
+    for (i = 0; i < count; i++) {
+        scheduleTime(t0, (records[i].start - base) / speed, &due);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+            ;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (records[i].records > 0)
+            connected = connected && replayFrame(sock_fd, accepted, payload, records[i].length, records[i].records);
+        result.ok = (records[i].records > 0) ? connected
+            : requestRange(port, auth_message, records[i].options & (OPTION_PACKED | OPTION_CHECKSUM),
+                payload, payload, records[i].length, null_fd, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        result.latency = ((end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec)) / 1000;
+        if (write(results_fd, &result, sizeof(result)) != sizeof(result))
+            perror("write()");
+    }
+
+    if (sock_fd >= 0)
+        close(sock_fd);
+    close(null_fd);
+    free(auth);
+    auth = NULL;
+}
+
+/**
+ * Sends a batch frame of len characters of payload, as text and key, split
+ * evenly into records, over the connection determined by the socket file
+ * descriptor and receives the response. Returns 1 if it arrived whole.
+ */
+int replayFrame(int sock_fd, int accepted, const char* payload, long len, long records) {
+    struct transfer request;
+    struct transfer response;
+    struct iovec iov[4];
+    char header[AUTH_BUFFER_SIZE];
+    char* buffer;
+    uint32_t* ends;
+    uint32_t* table;
+    long i;
+    int ret;
+
+    ends = (uint32_t*)malloc(records * sizeof(uint32_t) + 1);
+    table = (uint32_t*)malloc(records * sizeof(uint32_t) + 1);
+    buffer = allocBuffer(len + 1);
+    for (i = 0; i < records; i++)
+        ends[i] = htonl((i + 1) * len / records);
+    snprintf(header, sizeof(header), "%ld%s", records, MESSAGE_SEPERATOR);
+
+    beginTransfer(&request, 0, 0);
+    beginTransfer(&response, 0, 0);
+    request.checksum = response.checksum = accepted & OPTION_CHECKSUM;
+    iov[0].iov_base = header;
+    iov[0].iov_len = strlen(header);
+    iov[1].iov_base = ends;
+    iov[1].iov_len = records * sizeof(uint32_t);
+    iov[2].iov_base = (char*)payload;
+    iov[2].iov_len = len;
+    iov[3].iov_base = (char*)payload;
+    iov[3].iov_len = len;
+    ret = ((accepted & OPTION_PACKED)
+        ? sendVector(sock_fd, iov, 2, &request) && sendPacked(sock_fd, payload, len, &request)
+            && sendPacked(sock_fd, payload, len, &request)
+        : sendVector(sock_fd, iov, 4, &request)) && sendChecksum(sock_fd, &request);
+
+    ret = ret && getFrameLength(sock_fd, &response) == records
+        && recvAll(sock_fd, (char*)table, records * sizeof(uint32_t), &response)
+        && ((accepted & OPTION_PACKED) ? recvPacked(sock_fd, buffer, len, &response)
+            : recvAll(sock_fd, buffer, len, &response))
+        && recvChecksum(sock_fd, &response);
+
+    free(ends);
+    ends = NULL;
+    free(table);
+    table = NULL;
+    releaseBuffer(buffer);
+    buffer = NULL;
+    return ret;
+}
+
+/**
+ * Replays the count records of a trace sorted by compareRecords() against the
+ * server at port at the given speed, forking a process for each recorded
+ * connection when it is due, with up to MAX_REPLAY_PROCESSES at a time.
+ * 
+ * Stores the result of every request in results, allocated with malloc(), and
+ * returns their number or -1 on failure.
+ */
+long replayTrace(const struct traceRecord* records, long count, int port, double speed, const char* payload, struct replayResult** results) {
+    struct replayConnection* connections;
+    struct timespec t0;
+    struct timespec due;
+    struct stat info;
+    FILE* results_file;
+    long num_connections;
+    long num_results;
+    long i;
+    int results_fd;
+    int running;
+    pid_t pid;
+
+    connections = (struct replayConnection*)malloc(count * sizeof(struct replayConnection));
+    num_connections = 0;
+    for (i = 0; i < count; i++) {
+        if (i == 0 || records[i].sequence == 0 || records[i].connection != records[i - 1].connection) {
+            connections[num_connections].start = records[i].start;
+            connections[num_connections].first = i;
+            connections[num_connections++].count = 0;
+        }
+        connections[num_connections - 1].count++;
+    }
+    qsort(connections, num_connections, sizeof(struct replayConnection), compareConnections);
+
+    // Processes append fixed-size results to a shared file, which they can do
+    // without interleaving
+    results_file = tmpfile();
+    if (!results_file) {
+        perror("tmpfile()");
+        free(connections);
+        return -1;
+    }
+    results_fd = fileno(results_file);
+    fcntl(results_fd, F_SETFL, O_APPEND);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    running = 0;
+    for (i = 0; i < num_connections; i++) {
+        scheduleTime(&t0, (connections[i].start - connections[0].start) / speed, &due);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+            ;
+        while (running >= MAX_REPLAY_PROCESSES && wait(NULL) > 0)
+            running--;
+        while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+            running--;
+
+        pid = fork();
+        if (pid == 0) {
+            replayConnection(&records[connections[i].first], connections[i].count, port, speed,
+                &t0, connections[0].start, payload, results_fd);
+            _exit(0);
+        }
+        if (pid < 0)
+            perror("fork()");
+        else
+            running++;
+    }
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+
+    fstat(results_fd, &info);
+    num_results = info.st_size / sizeof(struct replayResult);
+    *results = (struct replayResult*)malloc(num_results * sizeof(struct replayResult) + 1);
+    if (pread(results_fd, *results, num_results * sizeof(struct replayResult), 0)
+        != num_results * sizeof(struct replayResult)) {
+            perror("pread()");
+            num_results = -1;
+    }
+
+    fclose(results_file);
+    free(connections);
+    connections = NULL;
+    return num_results;
+}
+
+/**
+ * Stores in due the time offset nanoseconds after t0.
+ */
+void scheduleTime(const struct timespec* t0, double offset, struct timespec* due) {
+    long long ns;
+
+    ns = t0->tv_nsec + (long long)offset;
+    due->tv_sec = t0->tv_sec + ns / 1000000000LL;
+    due->tv_nsec = ns % 1000000000LL;
+}
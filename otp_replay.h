@@ -0,0 +1,43 @@
+#ifndef __OTP_REPLAY_H__
+#define __OTP_REPLAY_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#define MAX_REPLAY_PROCESSES 256
+
+/**
+ * Connection of a trace to be replayed, made of the count records from first
+ * in a trace sorted by connection, the earliest of which started at start.
+ */
+struct replayConnection {
+    uint64_t start;
+    long first;
+    long count;
+};
+
+/**
+ * Outcome of one replayed request: its latency in microseconds as seen by the
+ * client and whether it succeeded.
+ */
+struct replayResult {
+    uint32_t latency;
+    uint32_t ok;
+};
+
+struct traceRecord;
+
+int compareConnections(const void*, const void*);
+int compareLatency(const void*, const void*);
+void compareLatencies(struct replayResult*, long, struct replayResult*, long);
+int compareRecords(const void*, const void*);
+struct traceRecord* loadTrace(const char*, long*);
+uint32_t percentileLatency(struct replayResult*, long, double);
+void printLatencies(const char*, struct replayResult*, long);
+void printTrace(const struct traceRecord*, long);
+void replayConnection(const struct traceRecord*, long, int, double, const struct timespec*, uint64_t, const char*, int);
+int replayFrame(int, int, const char*, long, long);
+long replayTrace(const struct traceRecord*, long, int, double, const char*, struct replayResult**);
+void scheduleTime(const struct timespec*, double, struct timespec*);
+
+#endif /* __OTP_REPLAY_H__ */
\ No newline at end of file